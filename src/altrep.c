@@ -0,0 +1,391 @@
+#include <stdint.h>
+#include <string.h>
+#include <Rinternals.h>
+#include <R_ext/Rdynload.h>
+#include <R_ext/Altrep.h>
+#include "store.h"
+
+/* A numeric vector that stores single precision floats in a raw vector, such that large
+ * spectrograms take half the memory. Values are converted to double on access. The full
+ * double vector is only created if R asks for a pointer to the data, for example when
+ * the vector gets modified. data1 holds the raw vector, data2 the expanded doubles. */
+static R_altrep_class_t float32_class;
+
+static const float *float32_data(SEXP x){
+  return (const float *) RAW(R_altrep_data1(x));
+}
+
+static R_xlen_t float32_length(SEXP x){
+  return Rf_xlength(R_altrep_data1(x)) / sizeof(float);
+}
+
+static double float32_elt(SEXP x, R_xlen_t i){
+  SEXP expanded = R_altrep_data2(x);
+  if(expanded != R_NilValue)
+    return REAL(expanded)[i];
+  return float32_data(x)[i];
+}
+
+static R_xlen_t float32_get_region(SEXP x, R_xlen_t start, R_xlen_t size, double *buf){
+  R_xlen_t n = float32_length(x) - start;
+  if(n > size)
+    n = size;
+  SEXP expanded = R_altrep_data2(x);
+  if(expanded != R_NilValue){
+    memcpy(buf, REAL(expanded) + start, n * sizeof(double));
+  } else {
+    const float *data = float32_data(x) + start;
+    for(R_xlen_t i = 0; i < n; i++)
+      buf[i] = data[i];
+  }
+  return n;
+}
+
+static void *float32_dataptr(SEXP x, Rboolean writeable){
+  SEXP expanded = R_altrep_data2(x);
+  if(expanded == R_NilValue){
+    R_xlen_t n = float32_length(x);
+    expanded = PROTECT(Rf_allocVector(REALSXP, n));
+    float32_get_region(x, 0, n, REAL(expanded));
+    R_set_altrep_data2(x, expanded);
+    UNPROTECT(1);
+  }
+  return REAL(expanded);
+}
+
+static const void *float32_dataptr_or_null(SEXP x){
+  SEXP expanded = R_altrep_data2(x);
+  return expanded == R_NilValue ? NULL : REAL(expanded);
+}
+
+/* The floats are never modified, so copies can share them until expanded */
+static SEXP float32_duplicate(SEXP x, Rboolean deep){
+  if(R_altrep_data2(x) != R_NilValue)
+    return NULL;
+  return R_new_altrep(float32_class, R_altrep_data1(x), R_NilValue);
+}
+
+/* Once expanded the vector may have been modified, so serialize it as a regular vector */
+static SEXP float32_serialized_state(SEXP x){
+  return R_altrep_data2(x) == R_NilValue ? R_altrep_data1(x) : NULL;
+}
+
+static SEXP float32_unserialize(SEXP class, SEXP state){
+  return R_new_altrep(float32_class, state, R_NilValue);
+}
+
+static Rboolean float32_inspect(SEXP x, int pre, int deep, int pvec, void (*inspect_subtree)(SEXP, int, int, int)){
+  Rprintf("av float32 (len=%lld, expanded=%s)\n", (long long) float32_length(x),
+          R_altrep_data2(x) == R_NilValue ? "false" : "true");
+  return TRUE;
+}
+
+/* Wraps a raw vector with (native endian) floats */
+SEXP new_float32_vector(SEXP data){
+  return R_new_altrep(float32_class, data, R_NilValue);
+}
+
+/* Vectors backed by a file from store.c. Pages of the file are loaded by the OS when they
+ * are accessed, so the data never needs to fit in memory as a whole. data1 is an external
+ * pointer to the read-only store, with the path as its protected value. The mapping is
+ * copy-on-write, and data2 is set once R asked for a writeable pointer, after which the
+ * vector is no longer serialized as a reference to the file. For float32 data2 holds the
+ * expanded doubles, as for the float32 class above. */
+static R_altrep_class_t store_integer_class;
+static R_altrep_class_t store_real_class;
+static R_altrep_class_t store_float32_class;
+static R_altrep_class_t store_raw_class;
+SEXP open_store_vector(SEXP path);
+
+static mapped_store *get_store(SEXP x){
+  mapped_store *store = R_ExternalPtrAddr(R_altrep_data1(x));
+  if(store == NULL)
+    Rf_error("File backed vector has been closed");
+  return store;
+}
+
+static void *store_ptr(SEXP x){
+  return store_data(get_store(x));
+}
+
+static R_xlen_t store_vector_length(SEXP x){
+  return store_length(get_store(x));
+}
+
+static void *store_dataptr(SEXP x, Rboolean writeable){
+  if(writeable && R_altrep_data2(x) == R_NilValue)
+    R_set_altrep_data2(x, Rf_ScalarLogical(TRUE));
+  return store_ptr(x);
+}
+
+static const void *store_dataptr_or_null(SEXP x){
+  return store_ptr(x);
+}
+
+static int store_integer_elt(SEXP x, R_xlen_t i){
+  return ((int *) store_ptr(x))[i];
+}
+
+static double store_real_elt(SEXP x, R_xlen_t i){
+  return ((double *) store_ptr(x))[i];
+}
+
+static Rbyte store_raw_elt(SEXP x, R_xlen_t i){
+  return ((Rbyte *) store_ptr(x))[i];
+}
+
+/* 16 bit samples are returned as raw bytes, as read_audio_bin() does for in-memory output */
+static R_xlen_t store_raw_length(SEXP x){
+  mapped_store *store = get_store(x);
+  return store_length(store) * store_elsize(store_get_type(store));
+}
+
+static R_xlen_t store_get_region(SEXP x, R_xlen_t start, R_xlen_t size, void *buf, size_t elsize){
+  R_xlen_t n = Rf_xlength(x) - start;
+  if(n > size)
+    n = size;
+  if(n > 0)
+    memcpy(buf, (uint8_t *) store_ptr(x) + start * elsize, n * elsize);
+  return n;
+}
+
+static R_xlen_t store_integer_get_region(SEXP x, R_xlen_t start, R_xlen_t size, int *buf){
+  return store_get_region(x, start, size, buf, sizeof(int));
+}
+
+static R_xlen_t store_real_get_region(SEXP x, R_xlen_t start, R_xlen_t size, double *buf){
+  return store_get_region(x, start, size, buf, sizeof(double));
+}
+
+static R_xlen_t store_raw_get_region(SEXP x, R_xlen_t start, R_xlen_t size, Rbyte *buf){
+  return store_get_region(x, start, size, buf, 1);
+}
+
+static double store_float32_elt(SEXP x, R_xlen_t i){
+  SEXP expanded = R_altrep_data2(x);
+  if(expanded != R_NilValue)
+    return REAL(expanded)[i];
+  return ((float *) store_ptr(x))[i];
+}
+
+static R_xlen_t store_float32_get_region(SEXP x, R_xlen_t start, R_xlen_t size, double *buf){
+  R_xlen_t n = store_vector_length(x) - start;
+  if(n > size)
+    n = size;
+  SEXP expanded = R_altrep_data2(x);
+  if(expanded != R_NilValue){
+    memcpy(buf, REAL(expanded) + start, n * sizeof(double));
+  } else {
+    const float *data = (float *) store_ptr(x) + start;
+    for(R_xlen_t i = 0; i < n; i++)
+      buf[i] = data[i];
+  }
+  return n;
+}
+
+static void *store_float32_dataptr(SEXP x, Rboolean writeable){
+  SEXP expanded = R_altrep_data2(x);
+  if(expanded == R_NilValue){
+    R_xlen_t n = store_vector_length(x);
+    expanded = PROTECT(Rf_allocVector(REALSXP, n));
+    store_float32_get_region(x, 0, n, REAL(expanded));
+    R_set_altrep_data2(x, expanded);
+    UNPROTECT(1);
+  }
+  return REAL(expanded);
+}
+
+static const void *store_float32_dataptr_or_null(SEXP x){
+  SEXP expanded = R_altrep_data2(x);
+  return expanded == R_NilValue ? NULL : REAL(expanded);
+}
+
+static R_altrep_class_t store_class(mapped_store *store){
+  switch(store_get_type(store)){
+  case STORE_INT32: return store_integer_class;
+  case STORE_FLOAT32: return store_float32_class;
+  case STORE_INT16: return store_raw_class;
+  default: return store_real_class;
+  }
+}
+
+static SEXP new_store_vector(SEXP path);
+
+/* A copy maps the file again, such that writing to the copy does not modify the original.
+ * Once R has written to a vector, we let R make a regular copy of the data. */
+static SEXP store_duplicate(SEXP x, Rboolean deep){
+  if(R_altrep_data2(x) != R_NilValue)
+    return NULL;
+  return new_store_vector(R_ExternalPtrProtected(R_altrep_data1(x)));
+}
+
+static Rboolean store_inspect(SEXP x, int pre, int deep, int pvec, void (*inspect_subtree)(SEXP, int, int, int)){
+  Rprintf("av file backed (len=%lld, file=%s)\n", (long long) Rf_xlength(x),
+          CHAR(STRING_ELT(R_ExternalPtrProtected(R_altrep_data1(x)), 0)));
+  return TRUE;
+}
+
+static void finalize_store(SEXP ptr){
+  mapped_store *store = R_ExternalPtrAddr(ptr);
+  if(store != NULL){
+    R_ClearExternalPtr(ptr);
+    store_close(store);
+  }
+}
+
+/* Every vector has its own private mapping, writes by R never reach the file */
+static SEXP new_store_vector(SEXP path){
+  mapped_store *store = store_open(CHAR(STRING_ELT(path, 0)));
+  SEXP ptr = PROTECT(R_MakeExternalPtr(store, R_NilValue, path));
+  R_RegisterCFinalizerEx(ptr, finalize_store, TRUE);
+  SEXP out = R_new_altrep(store_class(store), ptr, R_NilValue);
+  UNPROTECT(1);
+  return out;
+}
+
+/* Maps a file created by store_create() and returns it as a vector, with the dimensions
+ * and sample rate from the header */
+SEXP open_store_vector(SEXP path){
+  SEXP out = PROTECT(new_store_vector(path));
+  mapped_store *store = get_store(out);
+  int64_t dims[3];
+  int ndims = store_dims(store, dims);
+  if(ndims > 1 && store_get_type(store) != STORE_INT16){
+    SEXP dim = PROTECT(Rf_allocVector(INTSXP, ndims));
+    for(int i = 0; i < ndims; i++)
+      INTEGER(dim)[i] = dims[i];
+    Rf_setAttrib(out, R_DimSymbol, dim);
+    UNPROTECT(1);
+  }
+  Rf_setAttrib(out, PROTECT(Rf_install("sample_rate")), Rf_ScalarInteger(store_sample_rate(store)));
+  UNPROTECT(2);
+  return out;
+}
+
+SEXP R_read_store(SEXP path){
+  return open_store_vector(path);
+}
+
+/* Audio samples that are decoded on demand, see R_new_lazy_audio() in fft.c. data1 is the
+ * external pointer to the decoder, data2 holds all samples once R asks for a pointer. */
+static R_altrep_class_t lazy_audio_class;
+R_xlen_t lazy_audio_length(SEXP ptr);
+const int *lazy_audio_data(SEXP ptr, R_xlen_t i, R_xlen_t *avail);
+
+static R_xlen_t lazy_length(SEXP x){
+  return lazy_audio_length(R_altrep_data1(x));
+}
+
+static int lazy_elt(SEXP x, R_xlen_t i){
+  SEXP expanded = R_altrep_data2(x);
+  if(expanded != R_NilValue)
+    return INTEGER(expanded)[i];
+  return *lazy_audio_data(R_altrep_data1(x), i, NULL);
+}
+
+static R_xlen_t lazy_get_region(SEXP x, R_xlen_t start, R_xlen_t size, int *buf){
+  R_xlen_t n = lazy_length(x) - start;
+  if(n > size)
+    n = size;
+  SEXP expanded = R_altrep_data2(x);
+  if(expanded != R_NilValue){
+    memcpy(buf, INTEGER(expanded) + start, n * sizeof(int));
+    return n;
+  }
+  for(R_xlen_t done = 0; done < n;){
+    R_xlen_t avail;
+    const int *data = lazy_audio_data(R_altrep_data1(x), start + done, &avail);
+    if(avail > n - done)
+      avail = n - done;
+    memcpy(buf + done, data, avail * sizeof(int));
+    done += avail;
+  }
+  return n;
+}
+
+static void *lazy_dataptr(SEXP x, Rboolean writeable){
+  SEXP expanded = R_altrep_data2(x);
+  if(expanded == R_NilValue){
+    R_xlen_t n = lazy_length(x);
+    expanded = PROTECT(Rf_allocVector(INTSXP, n));
+    lazy_get_region(x, 0, n, INTEGER(expanded));
+    R_set_altrep_data2(x, expanded);
+    UNPROTECT(1);
+  }
+  return INTEGER(expanded);
+}
+
+static const void *lazy_dataptr_or_null(SEXP x){
+  SEXP expanded = R_altrep_data2(x);
+  return expanded == R_NilValue ? NULL : INTEGER(expanded);
+}
+
+/* Copies share the decoder, such that setting attributes does not decode the input */
+static SEXP lazy_duplicate(SEXP x, Rboolean deep){
+  if(R_altrep_data2(x) != R_NilValue)
+    return NULL;
+  return R_new_altrep(lazy_audio_class, R_altrep_data1(x), R_NilValue);
+}
+
+static Rboolean lazy_inspect(SEXP x, int pre, int deep, int pvec, void (*inspect_subtree)(SEXP, int, int, int)){
+  Rprintf("av lazy audio (len=%lld, expanded=%s)\n", (long long) lazy_length(x),
+          R_altrep_data2(x) == R_NilValue ? "false" : "true");
+  return TRUE;
+}
+
+SEXP new_lazy_audio_vector(SEXP ptr){
+  return R_new_altrep(lazy_audio_class, ptr, R_NilValue);
+}
+
+static void register_store_class(R_altrep_class_t class){
+  R_set_altrep_Length_method(class, store_vector_length);
+  R_set_altrep_Inspect_method(class, store_inspect);
+  R_set_altrep_Duplicate_method(class, store_duplicate);
+  R_set_altvec_Dataptr_method(class, store_dataptr);
+  R_set_altvec_Dataptr_or_null_method(class, store_dataptr_or_null);
+}
+
+void register_altrep_classes(DllInfo *dll){
+  float32_class = R_make_altreal_class("float32", "av", dll);
+  R_set_altrep_Length_method(float32_class, float32_length);
+  R_set_altrep_Inspect_method(float32_class, float32_inspect);
+  R_set_altrep_Duplicate_method(float32_class, float32_duplicate);
+  R_set_altrep_Serialized_state_method(float32_class, float32_serialized_state);
+  R_set_altrep_Unserialize_method(float32_class, float32_unserialize);
+  R_set_altvec_Dataptr_method(float32_class, float32_dataptr);
+  R_set_altvec_Dataptr_or_null_method(float32_class, float32_dataptr_or_null);
+  R_set_altreal_Elt_method(float32_class, float32_elt);
+  R_set_altreal_Get_region_method(float32_class, float32_get_region);
+
+  store_integer_class = R_make_altinteger_class("store_integer", "av", dll);
+  register_store_class(store_integer_class);
+  R_set_altinteger_Elt_method(store_integer_class, store_integer_elt);
+  R_set_altinteger_Get_region_method(store_integer_class, store_integer_get_region);
+
+  store_real_class = R_make_altreal_class("store_real", "av", dll);
+  register_store_class(store_real_class);
+  R_set_altreal_Elt_method(store_real_class, store_real_elt);
+  R_set_altreal_Get_region_method(store_real_class, store_real_get_region);
+
+  store_raw_class = R_make_altraw_class("store_raw", "av", dll);
+  register_store_class(store_raw_class);
+  R_set_altrep_Length_method(store_raw_class, store_raw_length);
+  R_set_altraw_Elt_method(store_raw_class, store_raw_elt);
+  R_set_altraw_Get_region_method(store_raw_class, store_raw_get_region);
+
+  store_float32_class = R_make_altreal_class("store_float32", "av", dll);
+  register_store_class(store_float32_class);
+  R_set_altvec_Dataptr_method(store_float32_class, store_float32_dataptr);
+  R_set_altvec_Dataptr_or_null_method(store_float32_class, store_float32_dataptr_or_null);
+  R_set_altreal_Elt_method(store_float32_class, store_float32_elt);
+  R_set_altreal_Get_region_method(store_float32_class, store_float32_get_region);
+
+  lazy_audio_class = R_make_altinteger_class("lazy_audio", "av", dll);
+  R_set_altrep_Length_method(lazy_audio_class, lazy_length);
+  R_set_altrep_Inspect_method(lazy_audio_class, lazy_inspect);
+  R_set_altrep_Duplicate_method(lazy_audio_class, lazy_duplicate);
+  R_set_altvec_Dataptr_method(lazy_audio_class, lazy_dataptr);
+  R_set_altvec_Dataptr_or_null_method(lazy_audio_class, lazy_dataptr_or_null);
+  R_set_altinteger_Elt_method(lazy_audio_class, lazy_elt);
+  R_set_altinteger_Get_region_method(lazy_audio_class, lazy_get_region);
+}
@@ -15,59 +15,144 @@ typedef struct FFTComplex {
 #endif
 
 #include <Rinternals.h>
+#include "threads.h"
+#include "store.h"
+#include "handle.h"
+
+/* Number of input samples (over all channels) that are decoded per chunk of FFT windows */
+#define FFT_CHUNK_SAMPLES (1 << 20)
+
+/* Lazy audio vectors decode blocks of this many samples (per channel), and cache a few */
+#define LAZY_BLOCK_SAMPLES 65536
+#define LAZY_CACHE_BLOCKS 8
 
 enum AmplitudeScale { AS_LINEAR, AS_SQRT, AS_CBRT, AS_LOG, NB_ASCALES };
 
+typedef void (*scale_kernel)(void *dst, const float *src, int n);
+
+SEXP new_float32_vector(SEXP data);
+SEXP open_store_vector(SEXP path);
+SEXP new_lazy_audio_vector(SEXP ptr);
+
 extern int total_open_handles;
 
+/* Sparse filterbank (mel or chroma) that is applied to the power spectrum of each window,
+ * optionally followed by conversion to dB, a dense projection (e.g. the DCT for MFCC) and
+ * normalization to a maximum of 1. The arrays point into R objects owned by the caller. */
 typedef struct {
-  int completed;
-  AVFormatContext *demuxer;
-  AVCodecContext *decoder;
-  AVStream *stream;
-} input_container;
+  int nb_filters;
+  int *length;
+  const int **index;
+  const double **weights;
+  int db;
+  int nb_outputs;
+  const double *projection;
+  int normalize;
+} feature_bank;
 
+/* Each worker owns its transform context and buffers. The old RDFT API works in place,
+ * in which case 'spectrum' points into 'samples'. */
 typedef struct {
-  uint8_t *buf;
-  SwrContext *swr;
 #ifdef NEW_FFT_TX_API
   AVTXContext *tx_ctx;
   av_tx_fn tx_fun;
 #else
-  FFTContext *fft;
+  RDFTContext *rdft;
 #endif
-  FFTComplex *fft_data;
+  float *samples;
+  FFTComplex *spectrum;
+  float *magnitude;
+  double *energy;
+} fft_worker;
+
+typedef struct {
+  uint8_t **planes;
+  SwrContext *swr;
+  AVPacket *pkt;
+  AVFrame *frame;
+  fft_worker *workers;
+  int nb_workers;
+  thread_pool *pool;
   AVAudioFifo *fifo;
   input_container *input;
+  /* Input of an av_open() handle, which is borrowed instead of opening the file */
+  input_container *handle;
   int channels;
   int winsize;
   float overlap;
   float *winvec;
-  float *src_data;
-  double *dst_dbl;
-  int *dst_int;
+  float *src_data[2];
+  int chunk_stride;
+  int array;
+  void *dst;
+  size_t dst_elsize;
+  int64_t dst_capacity;
+  int float32;
+  int sample_rate;
+  int64_t start_pts;
   int64_t end_pts;
+  int64_t elapsed;
+  int eof;
+  int max_frame_size;
+  /* The chunk of windows that is currently being transformed */
+  const float *chunk_data;
+  int chunk_size;
+  int chunk_windows;
+  int64_t chunk_offset;
+  int window_size;
+  int hop_size;
+  int output_range;
+  int out_size;
+  feature_bank *features;
+  float winscale;
+  scale_kernel scale;
+  void **read_planes;
+  /* Number of windows (FFT) or samples (PCM) written to dst */
+  int64_t dst_size;
+  /* The result is an R vector, except in batch mode where the file is read on a
+   * worker thread, and dst is native memory that is copied into R afterwards */
+  int native;
+  SEXP result;
+  PROTECT_INDEX result_idx;
+  int input_channels;
+  int input_sample_rate;
+  const char *codec_name;
+  /* Requested output: spectrum or PCM, number of channels (0 keeps the input channels) */
+  int is_fft;
+  int request_channels;
+  const char *filename;
+  /* PCM output format, planar formats store each channel in a column */
+  enum AVSampleFormat sample_fmt;
+  /* Streaming reader: index of the next sample, and the target of a pending seek */
+  int64_t position;
+  int64_t seek_target;
+  int seeking;
+  /* Out-of-core output: the result is written to a memory mapped file instead of R */
+  const char *out_file;
+  mapped_store *store;
+  /* Lazy vector: timestamps and positions of keyframe packets, and the decoded blocks */
+  int64_t *index_pts;
+  int64_t *index_pos;
+  int index_size;
+  int64_t total_samples;
+  int32_t *blocks[LAZY_CACHE_BLOCKS];
+  int64_t block_ids[LAZY_CACHE_BLOCKS];
+  int next_block;
 } spectrum_container;
 
-static size_t round_up(size_t v){
-  if(v == 0)
-    return 0;
-  v--;
-  v |= v >> 1;
-  v |= v >> 2;
-  v |= v >> 4;
-  v |= v >> 8;
-  v |= v >> 16;
-  /* 64 bit only */
-#if SIZE_MAX > 4294967296
-  v |= v >> 32;
-#endif
-  return ++v;
-}
+/* Reads many files on a thread pool, one file per task */
+typedef struct {
+  spectrum_container *settings;
+  const char **files;
+  spectrum_container **outputs;
+  int nb_files;
+  int nb_threads;
+  thread_pool *pool;
+} audio_batch;
 
 static void bail_if(int ret, const char * what){
   if(ret < 0)
-    Rf_errorcall(R_NilValue, "FFMPEG error in '%s': %s", what, av_err2str(ret));
+    raise_error("FFMPEG error in '%s': %s", what, av_err2str(ret));
 }
 
 static void bail_if_null(const void * ptr, const char * what){
@@ -75,110 +160,155 @@ static void bail_if_null(const void * ptr, const char * what){
     bail_if(-1, what);
 }
 
-static input_container * new_input_container(AVFormatContext *demuxer, AVCodecContext *decoder, AVStream *stream){
-  input_container *out = (input_container*) av_mallocz(sizeof(input_container));
-  out->demuxer = demuxer;
-  out->stream = stream;
-  out->decoder = decoder;
-  return out;
-}
-
 static void close_input(input_container **x){
   input_container *input = *x;
   if(input == NULL)
     return;
+  *x = NULL;
+  if(input->shared)
+    return;
   avcodec_free_context(&(input->decoder));
   avformat_close_input(&input->demuxer);
   avformat_free_context(input->demuxer);
   av_free(input);
-  *x = NULL;
 }
 
-static void close_spectrum_container(void *ptr, Rboolean jump){
-  total_open_handles--;
-  spectrum_container *s = ptr;
-  if(s->input)
-    close_input(&s->input);
+/* Frees the decoder and all buffers except the result. Does not use the R API. */
+static void release_input(spectrum_container *s){
+  /* Workers must be stopped before their buffers can be freed */
+  if(s->pool)
+    pool_free(s->pool);
+  for(int i = 0; i < s->nb_workers; i++){
 #ifdef NEW_FFT_TX_API
-  if(s->tx_ctx)
-    av_tx_uninit(&s->tx_ctx);
+    if(s->workers[i].tx_ctx)
+      av_tx_uninit(&s->workers[i].tx_ctx);
+    av_free(s->workers[i].spectrum);
 #else
-  if(s->fft)
-    av_fft_end(s->fft);
+    if(s->workers[i].rdft)
+      av_rdft_end(s->workers[i].rdft);
 #endif
+    av_free(s->workers[i].samples);
+    av_free(s->workers[i].magnitude);
+    av_free(s->workers[i].energy);
+  }
+  av_freep(&s->workers);
+  s->nb_workers = 0;
+  if(s->input)
+    close_input(&s->input);
+  av_packet_free(&s->pkt);
+  av_frame_free(&s->frame);
   if(s->fifo)
     av_audio_fifo_free(s->fifo);
+  s->fifo = NULL;
   if(s->swr)
     swr_free(&s->swr);
-  if(s->winvec)
-    av_free(s->winvec);
-  if(s->fft_data)
-    av_free(s->fft_data);
-  if(s->src_data)
-    av_free(s->src_data);
-  if(s->dst_dbl)
-    av_free(s->dst_dbl);
-  if(s->dst_int)
-    av_free(s->dst_int);
-  if(s->buf)
-    av_freep(&s->buf);
-}
-
-static int find_stream_type(AVFormatContext *demuxer, enum AVMediaType type){
-  for (int si = 0; si < demuxer->nb_streams; si++) {
-    AVStream *stream = demuxer->streams[si];
-    if(stream->codecpar->codec_type == type)
-      return si;
-  }
-  return -1;
-}
-
-static int find_stream_audio(AVFormatContext *demuxer, const char *file){
-  int out = find_stream_type(demuxer, AVMEDIA_TYPE_AUDIO);
-  if(out < 0){
-    avformat_close_input(&demuxer);
-    avformat_free_context(demuxer);
-    Rf_error("Input %s does not contain suitable audio stream", file);
-  }
-  return out;
+  av_freep(&s->winvec);
+  av_freep(&s->src_data[0]);
+  av_freep(&s->src_data[1]);
+  av_freep(&s->read_planes);
+  if(s->planes)
+    av_freep(&s->planes[0]);
+  av_freep(&s->planes);
+  av_freep(&s->index_pts);
+  av_freep(&s->index_pos);
+  for(int i = 0; i < LAZY_CACHE_BLOCKS; i++)
+    av_freep(&s->blocks[i]);
 }
 
-static input_container *open_input(const char *filename){
-  AVFormatContext *demuxer = NULL;
-  bail_if(avformat_open_input(&demuxer, filename, NULL, NULL), "avformat_open_input");
-  bail_if(avformat_find_stream_info(demuxer, NULL), "avformat_find_stream_info");
+static void free_spectrum_container(spectrum_container *s){
+  release_input(s);
+  store_close(s->store);
+  if(s->native)
+    av_free(s->dst);
+  av_free(s);
+}
+
+static void close_spectrum_container(void *ptr, Rboolean jump){
+  total_open_handles--;
+  free_spectrum_container(ptr);
+}
 
-  /* Try all input streams */
-  int si = find_stream_audio(demuxer, filename);
-  AVStream *stream = demuxer->streams[si];
-  const AVCodec *codec = avcodec_find_decoder(stream->codecpar->codec_id);
-  bail_if_null(codec, "avcodec_find_decoder");
-  AVCodecContext *decoder = avcodec_alloc_context3(codec);
-  bail_if(avcodec_parameters_to_context(decoder, stream->codecpar), "avcodec_parameters_to_context");
-  bail_if(avcodec_open2(decoder, codec, NULL), "avcodec_open2 (audio)");
+/* The input is attached to the container before opening, such that it gets freed with
+ * the container when opening fails halfway. The input of a handle is rewound instead. */
+static void open_input(spectrum_container *output, const char *filename, int threads){
+  input_container *input = output->handle;
+  if(input){
+    output->input = input;
+    open_audio_decoder(input, filename, threads);
+    rewind_input(input);
+  } else {
+    input = output->input = av_mallocz(sizeof(input_container));
+    bail_if(avformat_open_input(&input->demuxer, filename, NULL, NULL), "avformat_open_input");
+    bail_if(avformat_find_stream_info(input->demuxer, NULL), "avformat_find_stream_info");
+    open_audio_decoder(input, filename, threads);
+  }
+  AVCodecContext *decoder = input->decoder;
 #ifdef NEW_CHANNEL_API
-  if (decoder->ch_layout.order == AV_CHANNEL_ORDER_UNSPEC)
-    av_channel_layout_default(&decoder->ch_layout, decoder->ch_layout.nb_channels);
+  output->input_channels = decoder->ch_layout.nb_channels;
 #else
-  if(!decoder->channel_layout)
-    decoder->channel_layout = av_get_default_channel_layout(decoder->channels);
+  output->input_channels = decoder->channels;
 #endif
-  return new_input_container(demuxer, decoder, demuxer->streams[si]);
+  output->input_sample_rate = decoder->sample_rate;
+  output->codec_name = decoder->codec->name;
+  if(output->sample_rate <= 0)
+    output->sample_rate = decoder->sample_rate;
+  if(output->start_pts > 0)
+    av_seek_frame(input->demuxer, -1, output->start_pts, AVSEEK_FLAG_ANY);
+}
+
+/* Amplitude scales, applied to a whole window at once. The kernels are plain loops such
+ * that the compiler can vectorize them. */
+#define AMP_MIN 1e-6
+
+/* Kernels for double and single precision output */
+#define SCALE_KERNELS(type)                                                           \
+static void scale_linear_##type(void *out, const float *restrict src, int n){        \
+  type *restrict dst = out;                                                           \
+  for(int i = 0; i < n; i++)                                                          \
+    dst[i] = 1.0 - src[i];                                                            \
+}                                                                                     \
+static void scale_sqrt_##type(void *out, const float *restrict src, int n){          \
+  type *restrict dst = out;                                                           \
+  for(int i = 0; i < n; i++)                                                          \
+    dst[i] = 1.0 - sqrt(src[i]);                                                      \
+}                                                                                     \
+static void scale_cbrt_##type(void *out, const float *restrict src, int n){          \
+  type *restrict dst = out;                                                           \
+  for(int i = 0; i < n; i++)                                                          \
+    dst[i] = 1.0 - cbrt(src[i]);                                                      \
+}                                                                                     \
+static void scale_log_##type(void *out, const float *restrict src, int n){           \
+  type *restrict dst = out;                                                           \
+  const double factor = 1.0 / log(AMP_MIN);                                           \
+  for(int i = 0; i < n; i++)                                                          \
+    dst[i] = log(av_clipd(src[i], AMP_MIN, 1)) * factor;                              \
 }
 
-static double amp_scale(double a, int ascale){
-  double min = 1e-6;
+SCALE_KERNELS(double)
+SCALE_KERNELS(float)
+
+static scale_kernel get_scale_kernel(int ascale, int float32){
   switch(ascale) {
   case AS_SQRT:
-    return 1.0 - sqrt(a);
+    return float32 ? scale_sqrt_float : scale_sqrt_double;
   case AS_CBRT:
-    return 1.0 - cbrt(a);
+    return float32 ? scale_cbrt_float : scale_cbrt_double;
   case AS_LOG:
-    return log(av_clipd(a, min, 1)) / log(min);
-  case AS_LINEAR:
-    return 1.0 - a;
+    return float32 ? scale_log_float : scale_log_double;
   }
-  return a;
+  return float32 ? scale_linear_float : scale_linear_double;
+}
+
+static void apply_window(float *restrict dst, const float *restrict src, const float *restrict win, int n, int size){
+  for(int i = 0; i < n; i++)
+    dst[i] = src[i] * win[i];
+  memset(dst + n, 0, (size - n) * sizeof(*dst));
+}
+
+static void calc_magnitude(float *restrict dst, const FFTComplex *restrict src, int n, float winscale){
+  const float factor = 1.0f / winscale;
+  for(int i = 0; i < n; i++)
+    dst[i] = sqrtf(src[i].re * src[i].re + src[i].im * src[i].im) * factor;
 }
 
 /* https://stackoverflow.com/questions/14989397/how-to-convert-sample-rate-from-av-sample-fmt-fltp-to-av-sample-fmt-s16 */
@@ -196,23 +326,31 @@ static SwrContext *create_resampler(AVCodecContext *decoder, int64_t sample_rate
   return swr;
 }
 
-static SwrContext *create_resampler_fft(AVCodecContext *decoder, int64_t sample_rate){
+/* With channels = 0 we keep the input layout, such that channels are not remixed */
+static SwrContext *create_resampler_fft(AVCodecContext *decoder, int64_t sample_rate, int channels){
 #ifdef NEW_CHANNEL_API
   AVChannelLayout layout = {0};
-  av_channel_layout_default(&layout, 1);
-  return create_resampler(decoder, sample_rate, layout, AV_SAMPLE_FMT_FLTP);
+  if(channels > 0){
+    av_channel_layout_default(&layout, channels);
+  } else {
+    bail_if(av_channel_layout_copy(&layout, &decoder->ch_layout), "av_channel_layout_copy");
+  }
+  SwrContext *swr = create_resampler(decoder, sample_rate, layout, AV_SAMPLE_FMT_FLTP);
+  av_channel_layout_uninit(&layout);
+  return swr;
 #else
-  return create_resampler(decoder, sample_rate, AV_CH_LAYOUT_MONO, AV_SAMPLE_FMT_FLTP);
+  int64_t layout = channels > 0 ? av_get_default_channel_layout(channels) : decoder->channel_layout;
+  return create_resampler(decoder, sample_rate, layout, AV_SAMPLE_FMT_FLTP);
 #endif
 }
 
-static SwrContext *create_resampler_bin(AVCodecContext *decoder, int64_t sample_rate, int channels){
+static SwrContext *create_resampler_bin(AVCodecContext *decoder, int64_t sample_rate, int channels, enum AVSampleFormat fmt){
 #ifdef NEW_CHANNEL_API
   AVChannelLayout layout = {0};
   av_channel_layout_default(&layout, channels);
-  return create_resampler(decoder, sample_rate, layout, AV_SAMPLE_FMT_S32);
+  return create_resampler(decoder, sample_rate, layout, fmt);
 #else
-  return create_resampler(decoder, sample_rate, av_get_default_channel_layout(channels), AV_SAMPLE_FMT_S32);
+  return create_resampler(decoder, sample_rate, av_get_default_channel_layout(channels), fmt);
 #endif
 }
 
@@ -241,123 +379,467 @@ static int get_max_frame_size(AVCodecContext *decoder){
   return max_frame_size;
 }
 
-static SEXP run_fft(spectrum_container *output, int ascale){
-  AVPacket *pkt = av_packet_alloc();
-  AVFrame *frame = av_frame_alloc();
-  input_container * input = output->input;
+/* Grows or shrinks the file backed result, where each plane of old_plane bytes is moved
+ * to its new offset. Growing moves the last plane first, shrinking the first. */
+static uint8_t *resize_store(spectrum_container *output, int nb_planes, size_t old_plane, size_t new_plane, size_t done){
+  uint8_t *dst;
+  if(new_plane > old_plane){
+    store_resize(output->store, nb_planes * new_plane);
+    dst = store_data(output->store);
+    for(int i = nb_planes - 1; i > 0 && done > 0; i--)
+      memmove(dst + i * new_plane, dst + i * old_plane, done);
+  } else {
+    dst = store_data(output->store);
+    for(int i = 1; i < nb_planes && done > 0; i++)
+      memmove(dst + i * new_plane, dst + i * old_plane, done);
+    store_resize(output->store, nb_planes * new_plane);
+    dst = store_data(output->store);
+  }
+  return dst;
+}
+
+/* Number of output samples expected from the duration of the input, used to preallocate the result */
+static int64_t estimate_samples(spectrum_container *output){
+  int64_t duration = output->input->demuxer->duration;
+  if(duration == AV_NOPTS_VALUE || duration <= 0)
+    return 0;
+  if(output->end_pts > 0 && output->end_pts < duration)
+    duration = output->end_pts;
+  duration -= output->start_pts;
+  return duration > 0 ? av_rescale(duration, output->sample_rate, AV_TIME_BASE) : 0;
+}
+
+/* Allocates the result to hold n windows per channel: doubles, or floats in a raw vector.
+ * The channels are stored one after another, so the windows that are already done get
+ * copied into their new position, also for the final shrink to the actual size. In native
+ * mode this does not use the R API. */
+static void resize_output(spectrum_container *output, int64_t n){
+  size_t old_plane = output->dst_capacity * output->out_size * output->dst_elsize;
+  size_t new_plane = n * output->out_size * output->dst_elsize;
+  size_t done = FFMIN(output->dst_size, n) * output->out_size * output->dst_elsize;
+  uint8_t *old = output->dst;
+  uint8_t *dst;
+  if(output->store){
+    output->dst = resize_store(output, output->channels, old_plane, new_plane, done);
+    output->dst_capacity = n;
+    return;
+  }
+  if(output->native){
+    dst = av_malloc(FFMAX(1, output->channels * new_plane));
+    bail_if_null(dst, "av_malloc");
+  } else {
+    R_xlen_t len = output->channels * new_plane / (output->float32 ? 1 : sizeof(double));
+    SEXP out = Rf_allocVector(output->float32 ? RAWSXP : REALSXP, len);
+    REPROTECT(output->result = out, output->result_idx);
+    dst = output->float32 ? RAW(out) : (uint8_t *) REAL(out);
+  }
+  for(int ch = 0; ch < output->channels && done > 0; ch++)
+    memcpy(dst + ch * new_plane, old + ch * old_plane, done);
+  if(output->native)
+    av_free(old);
+  output->dst = dst;
+  output->dst_capacity = n;
+}
+
+/* Position of a decoded frame in output samples from the start of the stream */
+static int64_t stream_position(spectrum_container *output, int64_t pts){
+  AVStream *stream = output->input->stream;
+  if(pts == AV_NOPTS_VALUE)
+    return AV_NOPTS_VALUE;
+  if(stream->start_time != AV_NOPTS_VALUE)
+    pts -= stream->start_time;
+  return av_rescale_q(pts, stream->time_base, (AVRational){1, output->sample_rate});
+}
+
+static int64_t frame_position(spectrum_container *output, AVFrame *frame){
+  return stream_position(output, frame->best_effort_timestamp);
+}
+
+/* Inverse of stream_position(): the stream timestamp of an output sample */
+static int64_t sample_timestamp(spectrum_container *output, int64_t sample){
+  AVStream *stream = output->input->stream;
+  int64_t ts = av_rescale_q(sample, (AVRational){1, output->sample_rate}, stream->time_base);
+  if(stream->start_time != AV_NOPTS_VALUE)
+    ts += stream->start_time;
+  return ts;
+}
+
+/* After seeking the demuxer lands on a packet before the target, so we drop decoded
+ * samples until we reach the exact sample. The FIFO is empty while seeking. */
+static void skip_to_target(spectrum_container *output, int64_t frame_start){
+  int size = av_audio_fifo_size(output->fifo);
+  if(frame_start == AV_NOPTS_VALUE || frame_start >= output->seek_target){
+    output->position = frame_start == AV_NOPTS_VALUE ? output->seek_target : frame_start;
+    output->seeking = 0;
+  } else if(frame_start + size <= output->seek_target){
+    av_audio_fifo_reset(output->fifo);
+  } else {
+    bail_if(av_audio_fifo_drain(output->fifo, output->seek_target - frame_start), "av_audio_fifo_drain");
+    output->position = output->seek_target;
+    output->seeking = 0;
+  }
+}
+
+/* Decode and resample until the FIFO holds at least 'needed' samples, or the end of input */
+static void fill_fifo(spectrum_container *output, int needed){
+  input_container *input = output->input;
+  AVPacket *pkt = output->pkt;
+  AVFrame *frame = output->frame;
+  while(!output->eof && av_audio_fifo_size(output->fifo) < needed){
+    int ret = avcodec_receive_frame(input->decoder, frame);
+    if(ret == AVERROR(EAGAIN)){
+      ret = av_read_frame(input->demuxer, pkt);
+      if(ret == AVERROR_EOF){
+        bail_if(avcodec_send_packet(input->decoder, NULL), "avcodec_send_packet (flush)");
+      } else {
+        bail_if(ret, "av_read_frame");
+        if(pkt->stream_index == input->stream->index){
+          //av_packet_rescale_ts(pkt, input->stream->time_base, input->decoder->time_base);
+          bail_if(avcodec_send_packet(input->decoder, pkt), "avcodec_send_packet (audio)");
+
+          /* Check for elapsed time limit */
+          output->elapsed = av_rescale_q(pkt->pts, input->stream->time_base, AV_TIME_BASE_Q);
+          if(output->end_pts > 0 && output->elapsed > output->end_pts)
+            output->eof = 1;
+        }
+        av_packet_unref(pkt);
+      }
+    } else if(ret == AVERROR_EOF){
+      output->eof = 1;
+      break;
+    } else {
+      bail_if(ret, "avcodec_receive_frame");
+      int64_t frame_start = frame_position(output, frame);
+      int out_samples = swr_convert (output->swr, output->planes, output->max_frame_size, (const uint8_t**) frame->extended_data, frame->nb_samples);
+      bail_if(out_samples, "swr_convert");
+      av_frame_unref(frame);
+      int nb_written = av_audio_fifo_write(output->fifo, (void **) output->planes, out_samples);
+      bail_if(nb_written, "av_audio_fifo_write");
+      if(output->seeking)
+        skip_to_target(output, frame_start);
+    }
+    check_interrupt();
+  }
+}
+
+static void calc_features(double *restrict dst, const float *restrict magnitude, const feature_bank *fb, double *restrict energy){
+  for(int f = 0; f < fb->nb_filters; f++){
+    const int *index = fb->index[f];
+    const double *weights = fb->weights[f];
+    double sum = 0;
+    for(int i = 0; i < fb->length[f]; i++){
+      double m = magnitude[index[i]];
+      sum += weights[i] * m * m;
+    }
+    energy[f] = fb->db ? 10 * log10(FFMAX(sum, 1e-10)) : sum;
+  }
+  if(fb->projection){
+    for(int k = 0; k < fb->nb_outputs; k++){
+      double sum = 0;
+      for(int f = 0; f < fb->nb_filters; f++)
+        sum += fb->projection[k + f * fb->nb_outputs] * energy[f];
+      dst[k] = sum;
+    }
+  } else {
+    memcpy(dst, energy, fb->nb_filters * sizeof(*dst));
+  }
+  if(fb->normalize){
+    double max = 0;
+    for(int k = 0; k < fb->nb_outputs; k++)
+      max = FFMAX(max, dst[k]);
+    for(int k = 0; max > 0 && k < fb->nb_outputs; k++)
+      dst[k] /= max;
+  }
+}
+
+/* Window starting at sample w * hop_size of the chunk, zero padded at the end of input.
+ * Each channel goes through the same kernels and into its own plane of the output. */
+static void transform_window(spectrum_container *output, fft_worker *worker, int w){
+  int window_size = output->window_size;
+  int n_samples = FFMIN(window_size, output->chunk_size - w * output->hop_size);
+  for(int ch = 0; ch < output->channels; ch++){
+    const float *src = output->chunk_data + (int64_t) ch * output->chunk_stride + (int64_t) w * output->hop_size;
+    apply_window(worker->samples, src, output->winvec, n_samples, window_size);
+#ifdef NEW_FFT_TX_API
+    worker->tx_fun(worker->tx_ctx, worker->spectrum, worker->samples, sizeof(float));
+#else
+    /* Packed output: the imaginary part of the DC bin holds the real Nyquist bin */
+    av_rdft_calc(worker->rdft, worker->samples);
+    worker->spectrum[0].im = 0;
+#endif
+    calc_magnitude(worker->magnitude, worker->spectrum, output->output_range, output->winscale);
+    int64_t offset = (ch * output->dst_capacity + output->chunk_offset + w) * output->out_size;
+    if(output->features){
+      calc_features((double *) output->dst + offset, worker->magnitude, output->features, worker->energy);
+    } else {
+      output->scale((uint8_t *) output->dst + offset * output->dst_elsize, worker->magnitude, output->output_range);
+    }
+  }
+}
+
+/* Pointers to the channel planes of a chunk buffer, starting at sample 'pos' */
+static void **chunk_planes(spectrum_container *output, float *data, int pos){
+  void **planes = output->read_planes;
+  for(int ch = 0; ch < output->channels; ch++)
+    planes[ch] = data + (int64_t) ch * output->chunk_stride + pos;
+  return planes;
+}
+
+/* Task i transforms the i-th slice of the windows in the current chunk. May run on a worker thread,
+ * so it must not touch the R API. */
+static void transform_chunk(void *data, int i){
+  spectrum_container *output = data;
+  int64_t n = output->chunk_windows;
+  int from = n * i / output->nb_workers;
+  int to = n * (i + 1) / output->nb_workers;
+  for(int w = from; w < to; w++){
+    transform_window(output, &output->workers[i], w);
+    check_interrupt();
+  }
+}
+
+static void wait_for_workers(spectrum_container *output){
+  int n = output->nb_workers;
+  while(pool_wait(output->pool, 100) < n && pool_first_failed(output->pool) < 0)
+    check_interrupt();
+  int failed = pool_first_failed(output->pool);
+  if(failed >= 0){
+    pool_cancel(output->pool);
+    raise_error("%s", pool_error(output->pool, failed));
+  }
+  pool_free(output->pool);
+  output->pool = NULL;
+}
+
+/* The main thread decodes the input into chunks of samples. While the workers transform
+ * the windows of one chunk, the main thread decodes the next one into the other buffer.
+ * Every window is computed exactly as in the sequential version, so results do not
+ * depend on the number of threads. */
+static void run_fft(spectrum_container *output, int ascale){
   int fft_size = output->winsize;
   float overlap = output->overlap;
   int fft_bits = av_log2(fft_size);
   int window_size = 1 << fft_bits;
-  int hop_size = window_size * (1 - overlap);
+  int hop_size = FFMAX(1, window_size * (1 - overlap));
   int output_range = window_size / 2;
   /* https://ffmpeg.org/doxygen/3.2/group__lavu__sampmanip.html#ga4db4c77f928d32c7d8854732f50b8c04
    * 4x is a conservative multiplier for when the input samle_fmt is smaller than 32 bit (such as flac)*/
-  int max_frame_size = 4 * get_max_frame_size(output->input->decoder);
-  int iter = 0;
+  output->max_frame_size = 4 * get_max_frame_size(output->input->decoder);
+  output->window_size = window_size;
+  output->hop_size = hop_size;
+  output->output_range = output_range;
+  output->out_size = output->features ? output->features->nb_outputs : output_range;
+  output->scale = get_scale_kernel(ascale, output->float32);
+  output->workers = av_calloc(output->nb_workers, sizeof(fft_worker));
+  for(int i = 0; i < output->nb_workers; i++){
+    fft_worker *worker = &output->workers[i];
+    worker->samples = av_calloc(window_size + 2, sizeof(*worker->samples));
+    worker->magnitude = av_calloc(output_range, sizeof(*worker->magnitude));
+    if(output->features)
+      worker->energy = av_calloc(output->features->nb_filters, sizeof(*worker->energy));
 #ifdef NEW_FFT_TX_API
-  float scale = 1.0f;
-  av_tx_init(&output->tx_ctx, &output->tx_fun, AV_TX_FLOAT_FFT, 0,  window_size, &scale, AV_TX_INPLACE);
+    float scale = 1.0f;
+    bail_if(av_tx_init(&worker->tx_ctx, &worker->tx_fun, AV_TX_FLOAT_RDFT, 0, window_size, &scale, 0), "av_tx_init");
+    worker->spectrum = av_calloc(output_range + 1, sizeof(*worker->spectrum));
 #else
-  output->fft = av_fft_init(fft_bits, 0);
+    worker->rdft = av_rdft_init(fft_bits, DFT_R2C);
+    bail_if_null(worker->rdft, "av_rdft_init");
+    worker->spectrum = (FFTComplex *) worker->samples;
 #endif
-  output->fft_data = av_calloc(window_size, sizeof(*output->fft_data));
-  output->src_data = av_calloc(window_size, sizeof(*output->src_data));
-  output->fifo = av_audio_fifo_alloc(AV_SAMPLE_FMT_FLTP, 1, window_size);
-  av_samples_alloc(&output->buf, NULL, 1, max_frame_size, AV_SAMPLE_FMT_FLTP, 0);
-  double winscale = calc_window_scale(output->winsize, output->winvec);
-  int eof = 0;
-  int64_t elapsed = 0;
-  while(!eof){
+  }
 
-    /* Step 1: fill the FIFO with audio samples */
-    while(!eof && av_audio_fifo_size(output->fifo) < window_size){
-      int ret = avcodec_receive_frame(input->decoder, frame);
-      if(ret == AVERROR(EAGAIN)){
-        ret = av_read_frame(input->demuxer, pkt);
-        if(ret == AVERROR_EOF){
-          bail_if(avcodec_send_packet(input->decoder, NULL), "avcodec_send_packet (flush)");
-        } else {
-          bail_if(ret, "av_read_frame");
-          if(pkt->stream_index == input->stream->index){
-            //av_packet_rescale_ts(pkt, input->stream->time_base, input->decoder->time_base);
-            bail_if(avcodec_send_packet(input->decoder, pkt), "avcodec_send_packet (audio)");
-
-            /* Check for elapsed time limit */
-            elapsed = av_rescale_q(pkt->pts, input->stream->time_base, AV_TIME_BASE_Q);
-            if(output->end_pts > 0 && elapsed > output->end_pts)
-              eof = 1;
-            av_packet_unref(pkt);
-          }
-        }
-      } else if(ret == AVERROR_EOF){
-        eof = 1;
-        break;
-      } else {
-        bail_if(ret, "avcodec_receive_frame");
-        int out_samples = swr_convert (output->swr, &output->buf, max_frame_size, (const uint8_t**) frame->extended_data, frame->nb_samples);
-        bail_if(out_samples, "swr_convert");
-        av_frame_unref(frame);
-        int nb_written = av_audio_fifo_write(output->fifo, (void **) &output->buf, out_samples);
-        bail_if(nb_written, "av_audio_fifo_write");
+  /* A chunk holds whole windows, plus the overlap that is carried over into the next chunk */
+  int chunk_windows = FFMAX(1, FFT_CHUNK_SAMPLES / output->channels / hop_size);
+  int chunk_capacity = (chunk_windows - 1) * hop_size + window_size;
+  int channels = output->channels;
+  output->chunk_stride = chunk_capacity;
+  output->src_data[0] = av_calloc((size_t) chunk_capacity * channels, sizeof(float));
+  output->src_data[1] = av_calloc((size_t) chunk_capacity * channels, sizeof(float));
+  output->read_planes = av_calloc(channels, sizeof(void*));
+  output->fifo = av_audio_fifo_alloc(AV_SAMPLE_FMT_FLTP, channels, chunk_capacity);
+  output->pkt = av_packet_alloc();
+  output->frame = av_frame_alloc();
+  bail_if(av_samples_alloc_array_and_samples(&output->planes, NULL, channels, output->max_frame_size, AV_SAMPLE_FMT_FLTP, 0),
+          "av_samples_alloc_array_and_samples");
+  output->winscale = calc_window_scale(output->winsize, output->winvec);
+
+  /* Transformed windows are written straight into the result, which rarely needs to grow */
+  output->dst_elsize = output->float32 ? sizeof(float) : sizeof(double);
+  resize_output(output, estimate_samples(output) / hop_size + 1);
+
+  int cur = 0;
+  fill_fifo(output, chunk_capacity);
+  int size = av_audio_fifo_read(output->fifo, chunk_planes(output, output->src_data[cur], 0), chunk_capacity);
+  bail_if(size, "av_audio_fifo_read");
+  int64_t iter = 0;
+  output->dst_size = 0;
+  while(1){
+    /* Until EOF we only take the windows that are complete */
+    int last = output->eof && av_audio_fifo_size(output->fifo) == 0;
+    int nwin = last ? (size + hop_size - 1) / hop_size :
+      size >= window_size ? (size - window_size) / hop_size + 1 : 0;
+    if(iter + nwin > output->dst_capacity)
+      resize_output(output, FFMAX(iter + nwin, output->dst_capacity * 3 / 2));
+    output->chunk_data = output->src_data[cur];
+    output->chunk_size = size;
+    output->chunk_windows = nwin;
+    output->chunk_offset = iter;
+    int threaded = output->nb_workers > 1 && nwin > 1;
+    if(threaded){
+      output->pool = pool_start(transform_chunk, output, output->nb_workers, output->nb_workers);
+    } else {
+      for(int w = 0; w < nwin; w++){
+        transform_window(output, &output->workers[0], w);
+        check_interrupt();
       }
-      R_CheckUserInterrupt();
     }
 
-    /* Step 2: read samples from the FIFO and store transformed data */
-    while ((av_audio_fifo_size(output->fifo) >= window_size) || (av_audio_fifo_size(output->fifo) > 0 && eof)) {
-      int n_samples = av_audio_fifo_peek(output->fifo, (void**) &(output->src_data), window_size);
-      bail_if(n_samples, "av_audio_fifo_peek");
-      const float *src = output->src_data;
-      FFTComplex *fft_channel = output->fft_data;
-      int n;
-      for (n = 0; n < n_samples; n++) {
-        fft_channel[n].re = src[n] * output->winvec[n];
-        fft_channel[n].im = 0;
-      }
-      for (; n < window_size; n++) {
-        fft_channel[n].re = 0;
-        fft_channel[n].im = 0;
-      }
-#ifdef NEW_FFT_TX_API
-      output->tx_fun(output->tx_ctx, fft_channel, fft_channel, sizeof(AVComplexFloat));
-#else
-      av_fft_permute(output->fft, fft_channel);
-      av_fft_calc(output->fft, fft_channel);
-#endif
-      output->dst_dbl = av_realloc(output->dst_dbl, round_up((iter+1) * output_range * sizeof(*output->dst_dbl)));
-      for (int n = 0; n < output_range; n++) {
-        FFTSample re = fft_channel[n].re;
-        FFTSample im = fft_channel[n].im;
-        output->dst_dbl[iter * output_range + n] = amp_scale(sqrt(re*re + im*im) / winscale, ascale);
+    /* Meanwhile decode the next chunk, starting with the remainder of the current one */
+    int next_size = 0;
+    if(!last){
+      int tail = size - nwin * hop_size;
+      for(int ch = 0; ch < channels; ch++){
+        float *plane = output->src_data[cur] + (int64_t) ch * chunk_capacity;
+        memcpy(output->src_data[!cur] + (int64_t) ch * chunk_capacity, plane + nwin * hop_size, tail * sizeof(float));
       }
-      av_audio_fifo_drain(output->fifo, hop_size);
-      R_CheckUserInterrupt();
-      iter++;
+      fill_fifo(output, chunk_capacity - tail);
+      int n_read = av_audio_fifo_read(output->fifo, chunk_planes(output, output->src_data[!cur], tail), chunk_capacity - tail);
+      bail_if(n_read, "av_audio_fifo_read");
+      next_size = tail + n_read;
     }
+    if(threaded)
+      wait_for_workers(output);
+    iter += nwin;
+    output->dst_size = iter;
+    if(last)
+      break;
+    cur = !cur;
+    size = next_size;
+  }
+}
+
+/* Completes the file backed result, and maps it again read-only as an R vector */
+static SEXP finish_store(spectrum_container *output, int ndims, const int64_t *dims){
+  store_finish(output->store, ndims, dims, output->sample_rate);
+  store_close(output->store);
+  output->store = NULL;
+  SEXP path = PROTECT(Rf_mkString(output->out_file));
+  SEXP out = open_store_vector(path);
+  UNPROTECT(1);
+  return out;
+}
+
+/* Converts the windows of a completed run_fft into an R matrix, or an array for multiple
+ * channels. The caller must have protected output->result with output->result_idx. */
+static SEXP fft_result(spectrum_container *output){
+  if(output->native){
+    /* Copy the native buffer into R */
+    void *buf = output->dst;
+    output->native = 0;
+    resize_output(output, output->dst_size);
+    av_free(buf);
+  } else if(output->dst_size != output->dst_capacity){
+    resize_output(output, output->dst_size);
+  }
+  SEXP out;
+  if(output->store){
+    int64_t store_dims[3] = {output->out_size, output->dst_size, output->channels};
+    out = PROTECT(finish_store(output, output->array ? 3 : 2, store_dims));
+  } else {
+    out = PROTECT(output->float32 ? new_float32_vector(output->result) : output->result);
   }
-  SEXP dims = PROTECT(Rf_allocVector(INTSXP, 2));
-  INTEGER(dims)[0] = output_range;
-  INTEGER(dims)[1] = iter;
-  SEXP out = PROTECT(Rf_allocVector(REALSXP, iter * output_range));
-  memcpy(REAL(out), output->dst_dbl, iter * output_range * sizeof(*output->dst_dbl));
+  SEXP dims = PROTECT(Rf_allocVector(INTSXP, output->array ? 3 : 2));
+  INTEGER(dims)[0] = output->out_size;
+  INTEGER(dims)[1] = output->dst_size;
+  if(output->array)
+    INTEGER(dims)[2] = output->channels;
   Rf_setAttrib(out, R_DimSymbol, dims);
-  Rf_setAttrib(out, PROTECT(Rf_install("endtime")), Rf_ScalarReal((double) elapsed / AV_TIME_BASE));
-  UNPROTECT(3);
+  Rf_setAttrib(out, PROTECT(Rf_install("endtime")), Rf_ScalarReal((double) output->elapsed / AV_TIME_BASE));
+  Rf_setAttrib(out, PROTECT(Rf_install("sample_rate")), Rf_ScalarInteger(output->sample_rate));
+  UNPROTECT(4);
   return out;
 }
 
-static SEXP run_bin(spectrum_container *output){
-  AVPacket *pkt = av_packet_alloc();
-  AVFrame *frame = av_frame_alloc();
+/* R vectors for the PCM formats: 32-bit integers and doubles map to native R types,
+ * int16 and float32 are stored in a raw vector */
+static SEXPTYPE bin_sexptype(enum AVSampleFormat fmt){
+  switch(av_get_packed_sample_fmt(fmt)){
+  case AV_SAMPLE_FMT_S32: return INTSXP;
+  case AV_SAMPLE_FMT_DBL: return REALSXP;
+  default: return RAWSXP;
+  }
+}
+
+static uint8_t *bin_dataptr(SEXP x){
+  switch(TYPEOF(x)){
+  case INTSXP: return (uint8_t *) INTEGER(x);
+  case REALSXP: return (uint8_t *) REAL(x);
+  default: return RAW(x);
+  }
+}
+
+/* Reallocates the PCM result to hold n samples per channel, in native mode without the R API.
+ * Planar output stores the channels one after another, which have to be moved when the
+ * result is resized, like for multichannel spectrograms. The final shrink to the actual
+ * number of samples is a copy as well. */
+static void resize_bin_output(spectrum_container *output, int64_t n){
+  int planar = av_sample_fmt_is_planar(output->sample_fmt);
+  int nb_planes = planar ? output->channels : 1;
+  size_t width = planar ? output->dst_elsize : output->dst_elsize * output->channels;
+  size_t done = FFMIN(output->dst_size, n) * width;
+  uint8_t *old = output->dst;
+  uint8_t *dst;
+  if(output->store){
+    output->dst = resize_store(output, nb_planes, output->dst_capacity * width, n * width, done);
+    output->dst_capacity = n;
+    return;
+  }
+  if(output->native){
+    dst = av_malloc(FFMAX(1, n * output->channels * output->dst_elsize));
+    bail_if_null(dst, "av_malloc");
+  } else {
+    SEXPTYPE type = bin_sexptype(output->sample_fmt);
+    R_xlen_t len = n * output->channels * (type == RAWSXP ? output->dst_elsize : 1);
+    SEXP out = Rf_allocVector(type, len);
+    REPROTECT(output->result = out, output->result_idx);
+    dst = bin_dataptr(out);
+  }
+  for(int i = 0; i < nb_planes && done > 0; i++)
+    memcpy(dst + i * n * width, old + i * output->dst_capacity * width, done);
+  if(output->native)
+    av_free(old);
+  output->dst = dst;
+  output->dst_capacity = n;
+}
+
+/* Pointers for swr_convert() to the position of sample 'pos' in the result */
+static uint8_t **bin_planes(spectrum_container *output, int64_t pos){
+  uint8_t **planes = (uint8_t **) output->read_planes;
+  if(av_sample_fmt_is_planar(output->sample_fmt)){
+    for(int ch = 0; ch < output->channels; ch++)
+      planes[ch] = (uint8_t *) output->dst + (ch * output->dst_capacity + pos) * output->dst_elsize;
+  } else {
+    planes[0] = (uint8_t *) output->dst + pos * output->channels * output->dst_elsize;
+  }
+  return planes;
+}
+
+static void run_bin(spectrum_container *output){
+  output->pkt = av_packet_alloc();
+  output->frame = av_frame_alloc();
+  AVPacket *pkt = output->pkt;
+  AVFrame *frame = output->frame;
   input_container * input = output->input;
   AVCodecContext *decoder = input->decoder;
   int max_frame_size = get_max_frame_size(decoder);
-  av_samples_alloc(&output->buf, NULL, output->channels, max_frame_size, AV_SAMPLE_FMT_S32, 0);
   int64_t elapsed = 0;
   int channels = output->channels;
-  int samplesize = channels * av_get_bytes_per_sample(AV_SAMPLE_FMT_S32);
-  int total_samples = 0;
+  output->dst_elsize = av_get_bytes_per_sample(output->sample_fmt);
+  output->read_planes = av_calloc(channels, sizeof(void*));
+
+  /* Samples are converted straight into the result, which rarely needs to grow */
+  resize_bin_output(output, estimate_samples(output) + max_frame_size);
+  int64_t total_samples = 0;
   int eof = 0;
   while(!eof){
     int ret = avcodec_receive_frame(input->decoder, frame);
@@ -372,91 +854,592 @@ static SEXP run_bin(spectrum_container *output){
           elapsed = av_rescale_q(pkt->pts, input->stream->time_base, AV_TIME_BASE_Q);
           if(output->end_pts > 0 && elapsed > output->end_pts)
             eof = 1;
-          av_packet_unref(pkt);
         }
+        av_packet_unref(pkt);
       }
     } else if(ret == AVERROR_EOF){
       eof = 1;
       break;
     } else {
       bail_if(ret, "avcodec_receive_frame");
-      int n_samples = swr_convert (output->swr, &output->buf, max_frame_size, (const uint8_t**) frame->extended_data, frame->nb_samples);
+      if(total_samples + max_frame_size > output->dst_capacity)
+        resize_bin_output(output, output->dst_capacity * 3 / 2 + max_frame_size);
+      int n_samples = swr_convert (output->swr, bin_planes(output, total_samples), max_frame_size, (const uint8_t**) frame->extended_data, frame->nb_samples);
       bail_if(n_samples, "swr_convert");
       if(n_samples < frame->nb_samples)
-        REprintf("Insufficient memory to recode all samples");
+        raise_warning("Insufficient memory to recode all samples");
       av_frame_unref(frame);
-      output->dst_int = av_realloc(output->dst_int, round_up((total_samples + n_samples) * samplesize));
-      memcpy(output->dst_int + total_samples * channels, output->buf, n_samples * samplesize);
       total_samples = total_samples + n_samples;
+      output->dst_size = total_samples;
     }
-    R_CheckUserInterrupt();
+    check_interrupt();
+  }
+  /* Only 32-bit integers can hit NA, which is the most negative value */
+  if(av_get_packed_sample_fmt(output->sample_fmt) == AV_SAMPLE_FMT_S32){
+    int planar = av_sample_fmt_is_planar(output->sample_fmt);
+    int64_t plane_size = planar ? total_samples : total_samples * channels;
+    for(int i = 0; i < (planar ? channels : 1); i++){
+      int32_t *samples = (int32_t *) output->dst + i * output->dst_capacity;
+      for(int64_t j = 0; j < plane_size; j++){
+        if(samples[j] == NA_INTEGER)
+          samples[j] = NA_INTEGER + 1;
+      }
+    }
+  }
+}
+
+/* Converts the samples of a completed run_bin into an R vector, or a matrix with a column
+ * for each channel in planar mode. The caller must have protected output->result with
+ * output->result_idx. */
+static SEXP bin_result(spectrum_container *output){
+  if(output->native){
+    /* Copy the native buffer into R */
+    void *buf = output->dst;
+    output->native = 0;
+    resize_bin_output(output, output->dst_size);
+    av_free(buf);
+  } else if(output->dst_size != output->dst_capacity){
+    resize_bin_output(output, output->dst_size);
+  }
+  int float32 = av_get_packed_sample_fmt(output->sample_fmt) == AV_SAMPLE_FMT_FLT;
+  int planar = av_sample_fmt_is_planar(output->sample_fmt);
+  SEXP out;
+  if(output->store){
+    int64_t dims[2] = {output->dst_size, output->channels};
+    if(!planar)
+      dims[0] *= output->channels;
+    out = PROTECT(finish_store(output, planar ? 2 : 1, dims));
+  } else {
+    out = PROTECT(float32 ? new_float32_vector(output->result) : output->result);
+  }
+  if(planar && TYPEOF(out) != RAWSXP){
+    SEXP dims = PROTECT(Rf_allocVector(INTSXP, 2));
+    INTEGER(dims)[0] = output->dst_size;
+    INTEGER(dims)[1] = output->channels;
+    Rf_setAttrib(out, R_DimSymbol, dims);
+    UNPROTECT(1);
   }
-  R_xlen_t outlen = total_samples * channels;
-  SEXP out = Rf_allocVector(INTSXP, outlen);
-  memcpy(INTEGER(out), output->dst_int, total_samples * samplesize);
-  for(int *ptr = INTEGER(out); ptr < INTEGER(out) + outlen; ptr++){
-    if(*ptr == NA_INTEGER)
-      *ptr = NA_INTEGER + 1;
+  Rf_setAttrib(out, PROTECT(Rf_install("channels")), Rf_ScalarInteger(output->channels));
+  Rf_setAttrib(out, PROTECT(Rf_install("sample_rate")), Rf_ScalarInteger(output->sample_rate));
+  UNPROTECT(3);
+  return out;
+}
+
+/* Opens the input and decodes it into output->dst. In native mode this does not use the
+ * R API, such that it can run on a worker thread. */
+static void read_audio_input(spectrum_container *output, const char *filename, int threads){
+  open_input(output, filename, threads);
+  AVCodecContext *decoder = output->input->decoder;
+  int channels = output->request_channels;
+  output->channels = channels > 0 ? channels : output->input_channels;
+  if(output->is_fft){
+    output->array = channels != 1;
+    output->swr = create_resampler_fft(decoder, output->sample_rate, channels);
+    run_fft(output, AS_LOG);
+  } else {
+    output->swr = create_resampler_bin(decoder, output->sample_rate, output->channels, output->sample_fmt);
+    run_bin(output);
   }
+}
+
+static SEXP input_info(spectrum_container *output){
+  SEXP out = PROTECT(Rf_allocVector(VECSXP, 3));
+  SEXP names = PROTECT(Rf_allocVector(STRSXP, 3));
+  SET_VECTOR_ELT(out, 0, Rf_ScalarInteger(output->input_channels));
+  SET_VECTOR_ELT(out, 1, Rf_ScalarInteger(output->input_sample_rate));
+  SET_VECTOR_ELT(out, 2, Rf_mkString(output->codec_name ? output->codec_name : ""));
+  SET_STRING_ELT(names, 0, Rf_mkChar("channels"));
+  SET_STRING_ELT(names, 1, Rf_mkChar("sample_rate"));
+  SET_STRING_ELT(names, 2, Rf_mkChar("codec"));
+  Rf_setAttrib(out, R_NamesSymbol, names);
+  UNPROTECT(2);
   return out;
 }
 
-static SEXP calculate_audio_fft(void *output){
-  total_open_handles++;
-  return run_fft(output, AS_LOG);
+static enum store_type output_store_type(spectrum_container *output){
+  if(output->is_fft)
+    return output->float32 ? STORE_FLOAT32 : STORE_DOUBLE;
+  switch(av_get_packed_sample_fmt(output->sample_fmt)){
+  case AV_SAMPLE_FMT_S16: return STORE_INT16;
+  case AV_SAMPLE_FMT_FLT: return STORE_FLOAT32;
+  case AV_SAMPLE_FMT_DBL: return STORE_DOUBLE;
+  default: return STORE_INT32;
+  }
 }
 
-static SEXP calculate_audio_bin(void *output){
+static SEXP calculate_audio(void *ptr){
+  spectrum_container *output = ptr;
   total_open_handles++;
-  return run_bin(output);
+  PROTECT_WITH_INDEX(output->result = R_NilValue, &output->result_idx);
+  if(output->out_file)
+    output->store = store_create(output->out_file, output_store_type(output));
+  read_audio_input(output, output->filename, 0);
+  SEXP out = output->is_fft ? fft_result(output) : bin_result(output);
+  UNPROTECT(1);
+  return out;
 }
 
-SEXP R_audio_fft(SEXP audio, SEXP window, SEXP overlap, SEXP sample_rate, SEXP start_time, SEXP end_time){
+/* Each file gets a fresh container with only the requested settings copied over, such that
+ * buffers, contexts and the result are never shared between files. The feature bank is
+ * read-only and owned by R, the window is owned by each container. */
+static spectrum_container *copy_settings(const spectrum_container *settings){
   spectrum_container *output = av_mallocz(sizeof(spectrum_container));
-  output->winsize = Rf_length(window);
-  output->winvec = to_float(window);
-  output->overlap = Rf_asReal(overlap);
-  output->input = open_input(CHAR(STRING_ELT(audio, 0)));
-  AVCodecContext *decoder = output->input->decoder;
-  int output_sample_rate = Rf_length(sample_rate) ? Rf_asInteger(sample_rate) : decoder->sample_rate;
-  output->swr = create_resampler_fft(decoder, output_sample_rate);
-  if(Rf_length(end_time)){
-    output->end_pts = Rf_asReal(end_time) * AV_TIME_BASE;
+  bail_if_null(output, "av_mallocz");
+  output->is_fft = settings->is_fft;
+  output->native = settings->native;
+  output->nb_workers = settings->nb_workers;
+  output->features = settings->features;
+  output->float32 = settings->float32;
+  output->winsize = settings->winsize;
+  output->overlap = settings->overlap;
+  output->sample_rate = settings->sample_rate;
+  output->sample_fmt = settings->sample_fmt;
+  output->request_channels = settings->request_channels;
+  output->start_pts = settings->start_pts;
+  output->end_pts = settings->end_pts;
+  return output;
+}
+
+/* Task i reads the i-th file on a worker thread. The decoder is released as soon as the
+ * file is done, only the native result is kept for the main thread. */
+static void read_batch_file(void *data, int i){
+  audio_batch *batch = data;
+  spectrum_container *output = batch->outputs[i] = copy_settings(batch->settings);
+  if(batch->settings->winvec){
+    output->winvec = av_memdup(batch->settings->winvec, output->winsize * sizeof(float));
+    bail_if_null(output->winvec, "av_memdup");
   }
-  if(Rf_length(start_time)){
-    double pos = Rf_asReal(start_time);
-    if(pos > 0)
-      av_seek_frame(output->input->demuxer, -1, pos * AV_TIME_BASE, AVSEEK_FLAG_ANY);
+  read_audio_input(output, batch->files[i], 1);
+  release_input(output);
+}
+
+/* Runs on the worker after read_batch_file() failed */
+static void free_batch_file(void *data, int i){
+  audio_batch *batch = data;
+  if(batch->outputs[i]){
+    free_spectrum_container(batch->outputs[i]);
+    batch->outputs[i] = NULL;
   }
-  SEXP out = PROTECT(R_UnwindProtect(calculate_audio_fft, output, close_spectrum_container, output, NULL));
-  Rf_setAttrib(out, PROTECT(Rf_install("sample_rate")), Rf_ScalarInteger(output_sample_rate));
-  UNPROTECT(2);
+}
+
+static void close_audio_batch(void *ptr, Rboolean jump){
+  total_open_handles--;
+  audio_batch *batch = ptr;
+  if(batch->pool)
+    pool_free(batch->pool);
+  for(int i = 0; i < batch->nb_files; i++){
+    if(batch->outputs[i])
+      free_spectrum_container(batch->outputs[i]);
+  }
+  free_spectrum_container(batch->settings);
+  av_free(batch->outputs);
+  av_free(batch->files);
+  av_free(batch);
+}
+
+/* Returns a list with the result for each file, or NULL for files that failed, in which
+ * case the 'errors' attribute holds the error message. */
+static SEXP calculate_audio_batch(void *ptr){
+  audio_batch *batch = ptr;
+  int n = batch->nb_files;
+  total_open_handles++;
+  SEXP out = PROTECT(Rf_allocVector(VECSXP, n));
+  SEXP errors = PROTECT(Rf_allocVector(STRSXP, n));
+  if(n > 0){
+    batch->pool = pool_start_with_cleanup(read_batch_file, free_batch_file, batch, n, batch->nb_threads);
+    while(pool_wait(batch->pool, 100) < n)
+      R_CheckUserInterrupt();
+  }
+  for(int i = 0; i < n; i++){
+    const char *error = pool_error(batch->pool, i);
+    SET_STRING_ELT(errors, i, error ? Rf_mkChar(error) : NA_STRING);
+    spectrum_container *output = batch->outputs[i];
+    if(error || output == NULL)
+      continue;
+    PROTECT_WITH_INDEX(output->result = R_NilValue, &output->result_idx);
+    SEXP res = PROTECT(output->is_fft ? fft_result(output) : bin_result(output));
+    if(output->is_fft)
+      Rf_setAttrib(res, PROTECT(Rf_install("input")), input_info(output));
+    SET_VECTOR_ELT(out, i, res);
+    UNPROTECT(output->is_fft ? 3 : 2);
+    batch->outputs[i] = NULL;
+    free_spectrum_container(output);
+  }
+  Rf_setAttrib(out, PROTECT(Rf_install("errors")), errors);
+  UNPROTECT(3);
   return out;
 }
 
-SEXP R_audio_bin(SEXP audio, SEXP channels, SEXP sample_rate, SEXP start_time, SEXP end_time){
-  spectrum_container *output = av_mallocz(sizeof(spectrum_container));
-  output->input = open_input(CHAR(STRING_ELT(audio, 0)));
+/* The features list holds the filter indices (0 based), filter weights, the dB flag,
+ * the projection matrix (or NULL) and the normalize flag. These are built for the
+ * window size by read_audio_features(), so they are not validated again here. */
+static feature_bank *get_feature_bank(SEXP features){
+  if(!Rf_length(features))
+    return NULL;
+  SEXP index = VECTOR_ELT(features, 0);
+  SEXP weights = VECTOR_ELT(features, 1);
+  SEXP projection = VECTOR_ELT(features, 3);
+  feature_bank *fb = (feature_bank *) R_alloc(1, sizeof(feature_bank));
+  fb->nb_filters = Rf_length(index);
+  fb->length = (int *) R_alloc(fb->nb_filters, sizeof(int));
+  fb->index = (const int **) R_alloc(fb->nb_filters, sizeof(int *));
+  fb->weights = (const double **) R_alloc(fb->nb_filters, sizeof(double *));
+  for(int f = 0; f < fb->nb_filters; f++){
+    SEXP idx = VECTOR_ELT(index, f);
+    fb->length[f] = Rf_length(idx);
+    fb->index[f] = INTEGER(idx);
+    fb->weights[f] = REAL(VECTOR_ELT(weights, f));
+  }
+  fb->db = Rf_asLogical(VECTOR_ELT(features, 2));
+  fb->projection = Rf_length(projection) ? REAL(projection) : NULL;
+  fb->nb_outputs = Rf_length(projection) ? Rf_nrows(projection) : fb->nb_filters;
+  fb->normalize = Rf_asLogical(VECTOR_ELT(features, 4));
+  return fb;
+}
+
+static void set_time_range(spectrum_container *output, SEXP start_time, SEXP end_time){
   if(Rf_length(end_time)){
     output->end_pts = Rf_asReal(end_time) * AV_TIME_BASE;
   }
   if(Rf_length(start_time)){
     double pos = Rf_asReal(start_time);
     if(pos > 0)
-      av_seek_frame(output->input->demuxer, -1, pos * AV_TIME_BASE, AVSEEK_FLAG_ANY);
+      output->start_pts = pos * AV_TIME_BASE;
   }
-  AVCodecContext *decoder = output->input->decoder;
-  int output_sample_rate = Rf_length(sample_rate) ? Rf_asInteger(sample_rate) : decoder->sample_rate;
-#ifdef NEW_CHANNEL_API
-  int output_channels = Rf_length(channels) ? Rf_asInteger(channels) : decoder->ch_layout.nb_channels;
-#else
-  int output_channels = Rf_length(channels) ? Rf_asInteger(channels) : decoder->channels;
-#endif
-  output->channels = output_channels;
-  output->swr = create_resampler_bin(output->input->decoder, output_sample_rate, output_channels);
-  SEXP out = PROTECT(R_UnwindProtect(calculate_audio_bin, output, close_spectrum_container, output, NULL));
-  Rf_setAttrib(out, PROTECT(Rf_install("channels")), Rf_ScalarInteger(output_channels));
-  Rf_setAttrib(out, PROTECT(Rf_install("sample_rate")), Rf_ScalarInteger(output_sample_rate));
+}
+
+static spectrum_container *new_fft_settings(SEXP window, SEXP overlap, SEXP sample_rate, SEXP start_time,
+                                            SEXP end_time, SEXP float32, SEXP channels, SEXP features){
+  feature_bank *fb = get_feature_bank(features);
+  spectrum_container *output = av_mallocz(sizeof(spectrum_container));
+  output->is_fft = 1;
+  output->features = fb;
+  output->float32 = fb == NULL && Rf_asLogical(float32);
+  output->winsize = Rf_length(window);
+  output->winvec = to_float(window);
+  output->overlap = Rf_asReal(overlap);
+  output->sample_rate = Rf_length(sample_rate) ? Rf_asInteger(sample_rate) : 0;
+  output->request_channels = Rf_asInteger(channels);
+  set_time_range(output, start_time, end_time);
+  return output;
+}
+
+static spectrum_container *new_bin_settings(SEXP channels, SEXP sample_rate, SEXP start_time, SEXP end_time,
+                                            SEXP format, SEXP planar){
+  enum AVSampleFormat fmt = Rf_length(format) ? av_get_sample_fmt(CHAR(STRING_ELT(format, 0))) : AV_SAMPLE_FMT_S32;
+  if(fmt == AV_SAMPLE_FMT_NONE)
+    Rf_error("Unsupported sample format");
+  spectrum_container *output = av_mallocz(sizeof(spectrum_container));
+  output->sample_fmt = Rf_asLogical(planar) == TRUE ? av_get_planar_sample_fmt(fmt) : fmt;
+  output->sample_rate = Rf_length(sample_rate) ? Rf_asInteger(sample_rate) : 0;
+  output->request_channels = Rf_length(channels) ? Rf_asInteger(channels) : 0;
+  set_time_range(output, start_time, end_time);
+  return output;
+}
+
+static SEXP read_audio_batch(spectrum_container *settings, SEXP files, SEXP threads){
+  audio_batch *batch = av_mallocz(sizeof(audio_batch));
+  settings->native = 1;
+  settings->nb_workers = 1;
+  batch->settings = settings;
+  batch->nb_files = Rf_length(files);
+  batch->nb_threads = default_thread_count(Rf_asInteger(threads));
+  batch->files = av_calloc(batch->nb_files, sizeof(char*));
+  batch->outputs = av_calloc(batch->nb_files, sizeof(spectrum_container*));
+  for(int i = 0; i < batch->nb_files; i++)
+    batch->files[i] = CHAR(STRING_ELT(files, i));
+  return R_UnwindProtect(calculate_audio_batch, batch, close_audio_batch, batch, NULL);
+}
+
+/* Audio input is a path, or a handle from av_open() */
+static input_container *audio_handle(SEXP audio){
+  return is_media_handle(audio) ? media_handle_input(audio) : NULL;
+}
+
+static const char *audio_path(SEXP audio){
+  return is_media_handle(audio) ? media_handle_path(audio) : CHAR(STRING_ELT(audio, 0));
+}
+
+SEXP R_audio_fft(SEXP audio, SEXP window, SEXP overlap, SEXP sample_rate, SEXP start_time, SEXP end_time,
+                 SEXP threads, SEXP float32, SEXP channels, SEXP features, SEXP file){
+  input_container *handle = audio_handle(audio);
+  spectrum_container *output = new_fft_settings(window, overlap, sample_rate, start_time, end_time, float32, channels, features);
+  output->nb_workers = default_thread_count(Rf_asInteger(threads));
+  output->handle = handle;
+  output->filename = audio_path(audio);
+  output->out_file = Rf_length(file) ? CHAR(STRING_ELT(file, 0)) : NULL;
+  return R_UnwindProtect(calculate_audio, output, close_spectrum_container, output, NULL);
+}
+
+SEXP R_audio_bin(SEXP audio, SEXP channels, SEXP sample_rate, SEXP start_time, SEXP end_time,
+                 SEXP format, SEXP planar, SEXP file){
+  input_container *handle = audio_handle(audio);
+  spectrum_container *output = new_bin_settings(channels, sample_rate, start_time, end_time, format, planar);
+  output->handle = handle;
+  output->filename = audio_path(audio);
+  output->out_file = Rf_length(file) ? CHAR(STRING_ELT(file, 0)) : NULL;
+  return R_UnwindProtect(calculate_audio, output, close_spectrum_container, output, NULL);
+}
+
+SEXP R_audio_fft_batch(SEXP files, SEXP window, SEXP overlap, SEXP sample_rate, SEXP start_time, SEXP end_time,
+                       SEXP threads, SEXP float32, SEXP channels){
+  spectrum_container *settings = new_fft_settings(window, overlap, sample_rate, start_time, end_time, float32, channels, R_NilValue);
+  return read_audio_batch(settings, files, threads);
+}
+
+SEXP R_audio_bin_batch(SEXP files, SEXP channels, SEXP sample_rate, SEXP start_time, SEXP end_time,
+                       SEXP format, SEXP planar, SEXP threads){
+  spectrum_container *settings = new_bin_settings(channels, sample_rate, start_time, end_time, format, planar);
+  return read_audio_batch(settings, files, threads);
+}
+
+/* Streaming PCM reader: the spectrum_container lives in an external pointer between calls,
+ * and decoded samples are buffered in the FIFO until they are read */
+static void finalize_audio_reader(SEXP ptr){
+  spectrum_container *output = R_ExternalPtrAddr(ptr);
+  if(output != NULL){
+    R_ClearExternalPtr(ptr);
+    close_spectrum_container(output, FALSE);
+  }
+}
+
+static spectrum_container *get_audio_reader(SEXP ptr){
+  if(TYPEOF(ptr) != EXTPTRSXP || R_ExternalPtrAddr(ptr) == NULL)
+    Rf_error("Audio reader has been closed");
+  return R_ExternalPtrAddr(ptr);
+}
+
+static SEXP open_audio_reader(void *ptr){
+  spectrum_container *output = ptr;
+  open_input(output, output->filename, 0);
+  int channels = output->request_channels;
+  output->channels = channels > 0 ? channels : output->input_channels;
+  output->swr = create_resampler_bin(output->input->decoder, output->sample_rate, output->channels, AV_SAMPLE_FMT_S32);
+  output->max_frame_size = 4 * get_max_frame_size(output->input->decoder);
+  output->pkt = av_packet_alloc();
+  output->frame = av_frame_alloc();
+  output->fifo = av_audio_fifo_alloc(AV_SAMPLE_FMT_S32, output->channels, output->max_frame_size);
+  bail_if_null(output->fifo, "av_audio_fifo_alloc");
+  bail_if(av_samples_alloc_array_and_samples(&output->planes, NULL, output->channels, output->max_frame_size, AV_SAMPLE_FMT_S32, 0),
+          "av_samples_alloc_array_and_samples");
+  return R_NilValue;
+}
+
+static void abort_audio_reader(void *ptr, Rboolean jump){
+  if(jump)
+    close_spectrum_container(ptr, jump);
+}
+
+SEXP R_new_audio_reader(SEXP audio, SEXP channels, SEXP sample_rate){
+  spectrum_container *output = new_bin_settings(channels, sample_rate, R_NilValue, R_NilValue, R_NilValue, R_NilValue);
+  output->filename = CHAR(STRING_ELT(audio, 0));
+  total_open_handles++;
+  R_UnwindProtect(open_audio_reader, output, abort_audio_reader, output, NULL);
+  output->filename = NULL;
+  SEXP ptr = PROTECT(R_MakeExternalPtr(output, R_NilValue, audio));
+  R_RegisterCFinalizerEx(ptr, finalize_audio_reader, TRUE);
+  Rf_setAttrib(ptr, R_ClassSymbol, Rf_mkString("av_audio_reader"));
+  Rf_setAttrib(ptr, PROTECT(Rf_install("channels")), Rf_ScalarInteger(output->channels));
+  Rf_setAttrib(ptr, PROTECT(Rf_install("sample_rate")), Rf_ScalarInteger(output->sample_rate));
   UNPROTECT(3);
+  return ptr;
+}
+
+/* Returns the next block of at most n samples per channel, which is empty at the end of input */
+SEXP R_read_audio_block(SEXP ptr, SEXP n){
+  spectrum_container *output = get_audio_reader(ptr);
+  int size = Rf_asInteger(n);
+  fill_fifo(output, size);
+  if(output->seeking){
+    /* Target is beyond the end of the input */
+    output->position = output->seek_target;
+    output->seeking = 0;
+  }
+  int n_samples = FFMIN(size, av_audio_fifo_size(output->fifo));
+  SEXP out = PROTECT(Rf_allocVector(INTSXP, (R_xlen_t) n_samples * output->channels));
+  void *data = INTEGER(out);
+  bail_if(av_audio_fifo_read(output->fifo, &data, n_samples), "av_audio_fifo_read");
+  for(int *x = INTEGER(out); x < INTEGER(out) + Rf_xlength(out); x++){
+    if(*x == NA_INTEGER)
+      *x = NA_INTEGER + 1;
+  }
+  Rf_setAttrib(out, PROTECT(Rf_install("channels")), Rf_ScalarInteger(output->channels));
+  Rf_setAttrib(out, PROTECT(Rf_install("sample_rate")), Rf_ScalarInteger(output->sample_rate));
+  Rf_setAttrib(out, PROTECT(Rf_install("position")), Rf_ScalarReal(output->position));
+  output->position += n_samples;
+  UNPROTECT(4);
+  return out;
+}
+
+/* Seeks to the keyframe before timestamp ts, and decoded samples before the target sample
+ * get dropped by fill_fifo() */
+static void seek_reader(spectrum_container *output, int64_t target, int64_t ts){
+  AVStream *stream = output->input->stream;
+  bail_if(av_seek_frame(output->input->demuxer, stream->index, ts, AVSEEK_FLAG_BACKWARD), "av_seek_frame");
+  avcodec_flush_buffers(output->input->decoder);
+  /* Drop samples that are buffered in the resampler */
+  swr_free(&output->swr);
+  output->swr = create_resampler_bin(output->input->decoder, output->sample_rate, output->channels, AV_SAMPLE_FMT_S32);
+  av_audio_fifo_reset(output->fifo);
+  output->eof = 0;
+  output->seeking = 1;
+  output->seek_target = target;
+  output->position = target;
+}
+
+SEXP R_seek_audio_reader(SEXP ptr, SEXP sample){
+  spectrum_container *output = get_audio_reader(ptr);
+  int64_t target = (int64_t) Rf_asReal(sample);
+  seek_reader(output, target, sample_timestamp(output, target));
+  return ptr;
+}
+
+SEXP R_close_audio_reader(SEXP ptr){
+  finalize_audio_reader(ptr);
+  return R_NilValue;
+}
+
+/* Lazy audio vector: like the reader, but samples are accessed by index. When opened, all
+ * packets are read once (without decoding) to find the length and the keyframes. Blocks
+ * are decoded when they are first accessed, sequential access continues decoding where
+ * the previous block ended, other blocks seek to the nearest keyframe in the index. */
+static void build_seek_index(spectrum_container *output){
+  input_container *input = output->input;
+  AVPacket *pkt = output->pkt;
+  int capacity = 0;
+  int64_t total = 0;
+  int ret;
+  while((ret = av_read_frame(input->demuxer, pkt)) != AVERROR_EOF){
+    bail_if(ret, "av_read_frame");
+    if(pkt->stream_index == input->stream->index && pkt->pts != AV_NOPTS_VALUE){
+      if(pkt->flags & AV_PKT_FLAG_KEY){
+        if(output->index_size == capacity){
+          capacity = FFMAX(256, capacity * 2);
+          bail_if(av_reallocp_array(&output->index_pts, capacity, sizeof(int64_t)), "av_reallocp_array");
+          bail_if(av_reallocp_array(&output->index_pos, capacity, sizeof(int64_t)), "av_reallocp_array");
+        }
+        output->index_pts[output->index_size] = pkt->pts;
+        output->index_pos[output->index_size] = stream_position(output, pkt->pts);
+        output->index_size++;
+      }
+      total = FFMAX(total, stream_position(output, pkt->pts + pkt->duration));
+    }
+    av_packet_unref(pkt);
+    check_interrupt();
+  }
+  output->total_samples = total > 0 ? total : estimate_samples(output);
+}
+
+/* Last keyframe at or before the sample, or -1 */
+static int find_keyframe(spectrum_container *output, int64_t sample){
+  int lo = 0, hi = output->index_size - 1, found = -1;
+  while(lo <= hi){
+    int mid = (lo + hi) / 2;
+    if(output->index_pos[mid] <= sample){
+      found = mid;
+      lo = mid + 1;
+    } else {
+      hi = mid - 1;
+    }
+  }
+  return found;
+}
+
+/* Positions the decoder such that the FIFO starts at the target. The seek starts one
+ * keyframe early, because decoders such as mp3 need the previous packet to reproduce
+ * the exact samples. If the demuxer lands beyond the target we retry further back. */
+static void seek_lazy_audio(spectrum_container *output, int64_t target, int needed){
+  if(!output->seeking && output->position == target)
+    return;
+  int key = find_keyframe(output, target) - 1;
+  while(1){
+    int64_t ts = output->index_size ? output->index_pts[FFMAX(key, 0)] : sample_timestamp(output, 0);
+    seek_reader(output, target, ts);
+    fill_fifo(output, needed);
+    if(output->seeking){
+      /* Target is beyond the decoded samples */
+      output->position = target;
+      output->seeking = 0;
+    }
+    if(output->position <= target || key <= 0)
+      return;
+    key = FFMAX(0, key - 8);
+  }
+}
+
+static int32_t *load_lazy_block(spectrum_container *output, int64_t block){
+  for(int i = 0; i < LAZY_CACHE_BLOCKS; i++){
+    if(output->block_ids[i] == block && output->blocks[i])
+      return output->blocks[i];
+  }
+  int slot = output->next_block;
+  output->next_block = (slot + 1) % LAZY_CACHE_BLOCKS;
+  output->block_ids[slot] = -1;
+  size_t block_size = (size_t) LAZY_BLOCK_SAMPLES * output->channels * sizeof(int32_t);
+  if(output->blocks[slot] == NULL){
+    output->blocks[slot] = av_malloc(block_size);
+    bail_if_null(output->blocks[slot], "av_malloc");
+  }
+  int32_t *dst = output->blocks[slot];
+  memset(dst, 0, block_size);
+  int64_t target = block * LAZY_BLOCK_SAMPLES;
+  int n = FFMIN(LAZY_BLOCK_SAMPLES, output->total_samples - target);
+  seek_lazy_audio(output, target, n);
+  fill_fifo(output, n);
+
+  /* Samples that could not be decoded are left at zero */
+  int64_t offset = FFMAX(0, output->position - target);
+  int count = FFMIN(n - offset, av_audio_fifo_size(output->fifo));
+  if(count > 0){
+    void *data = dst + offset * output->channels;
+    bail_if(av_audio_fifo_read(output->fifo, &data, count), "av_audio_fifo_read");
+    output->position += count;
+  }
+  for(int32_t *x = dst; x < dst + (size_t) n * output->channels; x++){
+    if(*x == NA_INTEGER)
+      *x = NA_INTEGER + 1;
+  }
+  output->block_ids[slot] = block;
+  return dst;
+}
+
+R_xlen_t lazy_audio_length(SEXP ptr){
+  spectrum_container *output = get_audio_reader(ptr);
+  return output->total_samples * output->channels;
+}
+
+/* Pointer to (interleaved) sample i, and the number of samples that follow it in the block */
+const int *lazy_audio_data(SEXP ptr, R_xlen_t i, R_xlen_t *avail){
+  spectrum_container *output = get_audio_reader(ptr);
+  R_xlen_t block_length = (R_xlen_t) LAZY_BLOCK_SAMPLES * output->channels;
+  int64_t block = i / block_length;
+  R_xlen_t offset = i - block * block_length;
+  if(avail)
+    *avail = block_length - offset;
+  return (const int *) load_lazy_block(output, block) + offset;
+}
+
+static SEXP open_lazy_audio(void *ptr){
+  spectrum_container *output = ptr;
+  open_audio_reader(output);
+  build_seek_index(output);
+  for(int i = 0; i < LAZY_CACHE_BLOCKS; i++)
+    output->block_ids[i] = -1;
+  output->seeking = 1;
+  return R_NilValue;
+}
+
+SEXP R_new_lazy_audio(SEXP audio, SEXP channels, SEXP sample_rate){
+  spectrum_container *output = new_bin_settings(channels, sample_rate, R_NilValue, R_NilValue, R_NilValue, R_NilValue);
+  output->filename = CHAR(STRING_ELT(audio, 0));
+  total_open_handles++;
+  R_UnwindProtect(open_lazy_audio, output, abort_audio_reader, output, NULL);
+  output->filename = NULL;
+  SEXP ptr = PROTECT(R_MakeExternalPtr(output, R_NilValue, audio));
+  R_RegisterCFinalizerEx(ptr, finalize_audio_reader, TRUE);
+  SEXP out = PROTECT(new_lazy_audio_vector(ptr));
+  Rf_setAttrib(out, PROTECT(Rf_install("channels")), Rf_ScalarInteger(output->channels));
+  Rf_setAttrib(out, PROTECT(Rf_install("sample_rate")), Rf_ScalarInteger(output->sample_rate));
+  UNPROTECT(4);
   return out;
 }
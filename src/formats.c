@@ -26,6 +26,13 @@ enum AVSampleFormat get_default_sample_fmt(const AVCodec *codec){
   return p ? p[0] :AV_SAMPLE_FMT_NONE;
 }
 
+/* Enable frame and slice threading. A thread_count of 0 lets ffmpeg use all cores.
+ * This must be set before avcodec_open2() and does not affect frame order or pts. */
+void set_decoder_threads(AVCodecContext *decoder, int threads){
+  decoder->thread_count = threads;
+  decoder->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+}
+
 static SEXP safe_string(const char *x){
   if(x == NULL)
     return NA_STRING;
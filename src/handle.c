@@ -0,0 +1,152 @@
+#include <libavformat/avformat.h>
+#include <libavcodec/avcodec.h>
+#include <Rinternals.h>
+#include "avcompat.h"
+#include "threads.h"
+#include "handle.h"
+
+void set_decoder_threads(AVCodecContext *decoder, int threads);
+
+/* An av_open() handle keeps the demuxer open between calls, and the audio decoder once
+ * it has been used. Functions that accept a handle borrow the input, and rewind it
+ * before decoding, such that every call starts from the same position as a new file. */
+typedef struct {
+  input_container *input;
+  const char *filename;
+  int threads;
+} media_handle;
+
+static void bail_if(int ret, const char * what){
+  if(ret < 0)
+    raise_error("FFMPEG error in '%s': %s", what, av_err2str(ret));
+}
+
+static void bail_if_null(const void * ptr, const char * what){
+  if(!ptr)
+    bail_if(-1, what);
+}
+
+static void close_media_handle(media_handle *handle){
+  input_container *input = handle->input;
+  if(input){
+    avcodec_free_context(&input->decoder);
+    avformat_close_input(&input->demuxer);
+    av_free(input);
+  }
+  av_free(handle);
+}
+
+static void finalize_media_handle(SEXP ptr){
+  media_handle *handle = R_ExternalPtrAddr(ptr);
+  if(handle != NULL){
+    R_ClearExternalPtr(ptr);
+    close_media_handle(handle);
+  }
+}
+
+int is_media_handle(SEXP x){
+  return TYPEOF(x) == EXTPTRSXP && Rf_inherits(x, "av_handle");
+}
+
+static media_handle *get_media_handle(SEXP x){
+  if(!is_media_handle(x) || R_ExternalPtrAddr(x) == NULL)
+    Rf_error("Media handle has been closed");
+  return R_ExternalPtrAddr(x);
+}
+
+input_container *media_handle_input(SEXP x){
+  return get_media_handle(x)->input;
+}
+
+const char *media_handle_path(SEXP x){
+  return CHAR(STRING_ELT(R_ExternalPtrProtected(x), 0));
+}
+
+static int find_stream_audio(AVFormatContext *demuxer){
+  for (int si = 0; si < demuxer->nb_streams; si++) {
+    if(demuxer->streams[si]->codecpar->codec_type == AVMEDIA_TYPE_AUDIO)
+      return si;
+  }
+  return -1;
+}
+
+/* Opens the decoder for the first audio stream, unless that was done already */
+void open_audio_decoder(input_container *input, const char *filename, int threads){
+  if(input->decoder)
+    return;
+  int si = find_stream_audio(input->demuxer);
+  if(si < 0)
+    raise_error("Input %s does not contain suitable audio stream", filename);
+  AVStream *stream = input->demuxer->streams[si];
+  const AVCodec *codec = avcodec_find_decoder(stream->codecpar->codec_id);
+  bail_if_null(codec, "avcodec_find_decoder");
+  AVCodecContext *decoder = avcodec_alloc_context3(codec);
+  bail_if_null(decoder, "avcodec_alloc_context3");
+  /* The decoder is only attached to the input once it is opened */
+  int ret = avcodec_parameters_to_context(decoder, stream->codecpar);
+  if(ret >= 0){
+    set_decoder_threads(decoder, threads);
+    ret = avcodec_open2(decoder, codec, NULL);
+  }
+  if(ret < 0){
+    avcodec_free_context(&decoder);
+    bail_if(ret, "avcodec_open2 (audio)");
+  }
+#ifdef NEW_CHANNEL_API
+  if (decoder->ch_layout.order == AV_CHANNEL_ORDER_UNSPEC)
+    av_channel_layout_default(&decoder->ch_layout, decoder->ch_layout.nb_channels);
+#else
+  if(!decoder->channel_layout)
+    decoder->channel_layout = av_get_default_channel_layout(decoder->channels);
+#endif
+  input->decoder = decoder;
+  input->stream = stream;
+}
+
+/* Seeks back to the start of the input and drops frames that are buffered in the decoder */
+void rewind_input(input_container *input){
+  int64_t start = input->demuxer->start_time == AV_NOPTS_VALUE ? 0 : input->demuxer->start_time;
+  bail_if(av_seek_frame(input->demuxer, -1, start, AVSEEK_FLAG_BACKWARD), "av_seek_frame");
+  if(input->decoder)
+    avcodec_flush_buffers(input->decoder);
+  input->completed = 0;
+}
+
+static SEXP open_media_handle(void *ptr){
+  media_handle *handle = ptr;
+  input_container *input = handle->input;
+  bail_if(avformat_find_stream_info(input->demuxer, NULL), "avformat_find_stream_info");
+  if(find_stream_audio(input->demuxer) >= 0)
+    open_audio_decoder(input, handle->filename, handle->threads);
+  return R_NilValue;
+}
+
+static void abort_media_handle(void *ptr, Rboolean jump){
+  if(jump)
+    close_media_handle(ptr);
+}
+
+SEXP R_open_media(SEXP file, SEXP threads){
+  media_handle *handle = av_mallocz(sizeof(media_handle));
+  handle->filename = CHAR(STRING_ELT(file, 0));
+  handle->threads = Rf_asInteger(threads);
+  handle->input = av_mallocz(sizeof(input_container));
+  handle->input->shared = 1;
+  int ret = avformat_open_input(&handle->input->demuxer, handle->filename, NULL, NULL);
+  if(ret < 0){
+    close_media_handle(handle);
+    bail_if(ret, "avformat_open_input");
+  }
+  R_UnwindProtect(open_media_handle, handle, abort_media_handle, handle, NULL);
+  handle->filename = NULL;
+  SEXP ptr = PROTECT(R_MakeExternalPtr(handle, R_NilValue, file));
+  R_RegisterCFinalizerEx(ptr, finalize_media_handle, TRUE);
+  Rf_setAttrib(ptr, R_ClassSymbol, Rf_mkString("av_handle"));
+  UNPROTECT(1);
+  return ptr;
+}
+
+SEXP R_close_media(SEXP ptr){
+  finalize_media_handle(ptr);
+  return R_NilValue;
+}
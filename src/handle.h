@@ -0,0 +1,15 @@
+/* Demuxer and decoder of an input file. Inputs that belong to an av_open() handle are
+ * marked as shared, and are not closed by the functions that borrow them. */
+typedef struct {
+  int completed;
+  AVFormatContext *demuxer;
+  AVCodecContext *decoder;
+  AVStream *stream;
+  int shared;
+} input_container;
+
+int is_media_handle(SEXP x);
+input_container *media_handle_input(SEXP x);
+const char *media_handle_path(SEXP x);
+void open_audio_decoder(input_container *input, const char *filename, int threads);
+void rewind_input(input_container *input);
@@ -1,3 +1,7 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/stat.h>
 #include <libavcodec/avcodec.h>
 #include <libavformat/avformat.h>
 #include <libavfilter/buffersink.h>
@@ -8,7 +12,60 @@
 
 #include <Rinternals.h>
 #include "avcompat.h"
+#include "threads.h"
+#include "handle.h"
 
+/* Bounds for the fast probe, which skips most of the stream analysis */
+#define FAST_PROBE_SIZE "65536"
+#define FAST_ANALYZE_DURATION "500000"
+
+/* Probed files are cached by path, size and modification time. The cache is flushed
+ * once it holds this many files. */
+#define INFO_CACHE_BUCKETS 4096
+#define INFO_CACHE_MAX 65536
+
+/* Metadata of the first video and audio stream. The strings point to static FFmpeg
+ * names, such that probing does not use the R API and can run on worker threads. */
+typedef struct {
+  const char *file;
+  int fast;
+  char error[256];
+  double duration;
+  int has_video;
+  int width;
+  int height;
+  const char *video_codec;
+  int64_t video_frames;
+  double framerate;
+  const char *video_format;
+  int has_audio;
+  int channels;
+  int sample_rate;
+  const char *audio_codec;
+  int64_t audio_frames;
+  int64_t bitrate;
+  char layout[256];
+  const char *sample_fmt;
+} media_info;
+
+typedef struct cache_entry {
+  char *path;
+  int64_t size;
+  int64_t mtime;
+  media_info info;
+  struct cache_entry *next;
+} cache_entry;
+
+static cache_entry *info_cache[INFO_CACHE_BUCKETS];
+static int info_cache_size = 0;
+static pthread_mutex_t info_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+typedef struct {
+  media_info *items;
+  int nb_files;
+  int nb_threads;
+  thread_pool *pool;
+} info_batch;
 
 static SEXP safe_string(const char *x){
   if(x == NULL)
@@ -16,12 +73,182 @@ static SEXP safe_string(const char *x){
   return Rf_mkString(x);
 }
 
-static void bail_if(int ret, const char * what){
-  if(ret < 0)
-    Rf_errorcall(R_NilValue, "FFMPEG error in '%s': %s", what, av_err2str(ret));
+static void set_error(media_info *info, const char *what, int ret){
+  snprintf(info->error, sizeof(info->error), "FFMPEG error in '%s': %s", what, av_err2str(ret));
+}
+
+static void read_video_stream(media_info *info, AVFormatContext *demuxer, AVStream *stream){
+  const AVCodec *codec = avcodec_find_decoder(stream->codecpar->codec_id);
+  if(!codec){
+    snprintf(info->error, sizeof(info->error), "Failed to find codec");
+    return;
+  }
+  AVRational framerate = av_guess_frame_rate(demuxer, stream, NULL);
+  info->has_video = 1;
+  info->width = stream->codecpar->width;
+  info->height = stream->codecpar->height;
+  info->video_codec = codec->name;
+  info->video_frames = stream->nb_frames;
+  info->framerate = (double) framerate.num / framerate.den;
+  info->video_format = av_get_pix_fmt_name((enum AVPixelFormat) stream->codecpar->format);
+}
+
+static void read_audio_stream(media_info *info, AVStream *stream){
+  const AVCodec *codec = avcodec_find_decoder(stream->codecpar->codec_id);
+  if(!codec){
+    snprintf(info->error, sizeof(info->error), "Failed to find codec");
+    return;
+  }
+  info->has_audio = 1;
+#ifdef NEW_CHANNEL_API
+  info->channels = stream->codecpar->ch_layout.nb_channels;
+  av_channel_layout_describe(&stream->codecpar->ch_layout, info->layout, sizeof(info->layout));
+#else
+  info->channels = stream->codecpar->channels;
+  av_get_channel_layout_string(info->layout, sizeof(info->layout), stream->codecpar->channels, stream->codecpar->channel_layout);
+#endif
+  info->sample_rate = stream->codecpar->sample_rate;
+  info->audio_codec = codec->name;
+  info->audio_frames = stream->nb_frames;
+  info->bitrate = stream->codecpar->bit_rate;
+  info->sample_fmt = av_get_sample_fmt_name(stream->codecpar->format);
+}
+
+static void read_media_info(media_info *info, AVFormatContext *demuxer){
+  info->duration = demuxer->duration / 1e6;
+  for (int i = 0; i < demuxer->nb_streams && !info->error[0]; i++) {
+    AVStream *stream = demuxer->streams[i];
+    if(stream->codecpar->codec_type == AVMEDIA_TYPE_VIDEO && !info->has_video)
+      read_video_stream(info, demuxer, stream);
+    if(stream->codecpar->codec_type == AVMEDIA_TYPE_AUDIO && !info->has_audio)
+      read_audio_stream(info, stream);
+  }
+}
+
+/* Opens the file and reads the metadata, errors are stored in info->error */
+static void probe_media(media_info *info){
+  AVFormatContext *demuxer = NULL;
+  AVDictionary *opts = NULL;
+  if(info->fast){
+    av_dict_set(&opts, "probesize", FAST_PROBE_SIZE, 0);
+    av_dict_set(&opts, "analyzeduration", FAST_ANALYZE_DURATION, 0);
+  }
+  int ret = avformat_open_input(&demuxer, info->file, NULL, &opts);
+  av_dict_free(&opts);
+  if(ret < 0){
+    set_error(info, "avformat_open_input", ret);
+    return;
+  }
+  ret = avformat_find_stream_info(demuxer, NULL);
+  if(ret < 0){
+    set_error(info, "avformat_find_stream_info", ret);
+  } else {
+    read_media_info(info, demuxer);
+  }
+  avformat_close_input(&demuxer);
+}
+
+static unsigned int hash_path(const char *path){
+  unsigned int hash = 2166136261u;
+  for(const char *x = path; *x; x++)
+    hash = (hash ^ (unsigned char) *x) * 16777619u;
+  return hash % INFO_CACHE_BUCKETS;
+}
+
+static int file_stat(const char *path, int64_t *size, int64_t *mtime){
+  struct stat st;
+  if(stat(path, &st))
+    return -1;
+  *size = st.st_size;
+#if defined(__APPLE__)
+  *mtime = (int64_t) st.st_mtimespec.tv_sec * 1000000000 + st.st_mtimespec.tv_nsec;
+#elif defined(_WIN32)
+  *mtime = (int64_t) st.st_mtime * 1000000000;
+#else
+  *mtime = (int64_t) st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+#endif
+  return 0;
+}
+
+static void flush_info_cache(void){
+  for(int i = 0; i < INFO_CACHE_BUCKETS; i++){
+    while(info_cache[i]){
+      cache_entry *entry = info_cache[i];
+      info_cache[i] = entry->next;
+      av_free(entry->path);
+      av_free(entry);
+    }
+  }
+  info_cache_size = 0;
+}
+
+/* A full probe also answers requests for a fast probe, but not the other way around */
+static int lookup_info_cache(media_info *info, int64_t size, int64_t mtime){
+  int found = 0;
+  pthread_mutex_lock(&info_cache_lock);
+  for(cache_entry *entry = info_cache[hash_path(info->file)]; entry; entry = entry->next){
+    if(!strcmp(entry->path, info->file) && entry->size == size && entry->mtime == mtime &&
+       entry->info.fast <= info->fast){
+      const char *file = info->file;
+      int fast = info->fast;
+      *info = entry->info;
+      info->file = file;
+      info->fast = fast;
+      found = 1;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&info_cache_lock);
+  return found;
+}
+
+static void store_info_cache(media_info *info, int64_t size, int64_t mtime){
+  cache_entry *entry = av_mallocz(sizeof(cache_entry));
+  char *path = av_strdup(info->file);
+  if(entry == NULL || path == NULL){
+    av_free(entry);
+    av_free(path);
+    return;
+  }
+  entry->path = path;
+  entry->size = size;
+  entry->mtime = mtime;
+  entry->info = *info;
+  entry->info.file = NULL;
+  unsigned int bucket = hash_path(info->file);
+  pthread_mutex_lock(&info_cache_lock);
+  if(info_cache_size >= INFO_CACHE_MAX)
+    flush_info_cache();
+  /* Replaces an older entry for the same file */
+  for(cache_entry **x = &info_cache[bucket]; *x; x = &(*x)->next){
+    if(!strcmp((*x)->path, path)){
+      cache_entry *old = *x;
+      *x = old->next;
+      av_free(old->path);
+      av_free(old);
+      info_cache_size--;
+      break;
+    }
+  }
+  entry->next = info_cache[bucket];
+  info_cache[bucket] = entry;
+  info_cache_size++;
+  pthread_mutex_unlock(&info_cache_lock);
+}
+
+static void get_media_info(media_info *info){
+  int64_t size, mtime;
+  int cacheable = file_stat(info->file, &size, &mtime) == 0;
+  if(cacheable && lookup_info_cache(info, size, mtime))
+    return;
+  probe_media(info);
+  if(cacheable && !info->error[0])
+    store_info_cache(info, size, mtime);
 }
 
-static SEXP get_video_info(AVFormatContext *demuxer){
+static SEXP get_video_info(media_info *info){
+  if(!info->has_video)
+    return R_NilValue;
   SEXP names = PROTECT(Rf_allocVector(STRSXP, 6));
   SET_STRING_ELT(names, 0, Rf_mkChar("width"));
   SET_STRING_ELT(names, 1, Rf_mkChar("height"));
@@ -29,30 +256,21 @@ static SEXP get_video_info(AVFormatContext *demuxer){
   SET_STRING_ELT(names, 3, Rf_mkChar("frames"));
   SET_STRING_ELT(names, 4, Rf_mkChar("framerate"));
   SET_STRING_ELT(names, 5, Rf_mkChar("format"));
-  for (int i = 0; i < demuxer->nb_streams; i++) {
-    AVStream *stream = demuxer->streams[i];
-    if(stream->codecpar->codec_type != AVMEDIA_TYPE_VIDEO)
-      continue;
-    const AVCodec *codec = avcodec_find_decoder(stream->codecpar->codec_id);
-    if(!codec)
-      Rf_error("Failed to find codec");
-    AVRational framerate = av_guess_frame_rate(demuxer, stream, NULL);
-    SEXP streamdata = PROTECT(Rf_allocVector(VECSXP, Rf_length(names)));
-    SET_VECTOR_ELT(streamdata, 0, Rf_ScalarReal(stream->codecpar->width));
-    SET_VECTOR_ELT(streamdata, 1, Rf_ScalarReal(stream->codecpar->height));
-    SET_VECTOR_ELT(streamdata, 2, safe_string(codec->name));
-    SET_VECTOR_ELT(streamdata, 3, Rf_ScalarReal(stream->nb_frames ? stream->nb_frames : NA_REAL));
-    SET_VECTOR_ELT(streamdata, 4, Rf_ScalarReal((double)framerate.num / framerate.den));
-    SET_VECTOR_ELT(streamdata, 5, safe_string(av_get_pix_fmt_name((enum AVPixelFormat) stream->codecpar->format)));
-    Rf_setAttrib(streamdata, R_NamesSymbol, names);
-    UNPROTECT(2);
-    return streamdata;
-  }
-  UNPROTECT(1);
-  return R_NilValue;
+  SEXP streamdata = PROTECT(Rf_allocVector(VECSXP, Rf_length(names)));
+  SET_VECTOR_ELT(streamdata, 0, Rf_ScalarReal(info->width));
+  SET_VECTOR_ELT(streamdata, 1, Rf_ScalarReal(info->height));
+  SET_VECTOR_ELT(streamdata, 2, safe_string(info->video_codec));
+  SET_VECTOR_ELT(streamdata, 3, Rf_ScalarReal(info->video_frames ? info->video_frames : NA_REAL));
+  SET_VECTOR_ELT(streamdata, 4, Rf_ScalarReal(info->framerate));
+  SET_VECTOR_ELT(streamdata, 5, safe_string(info->video_format));
+  Rf_setAttrib(streamdata, R_NamesSymbol, names);
+  UNPROTECT(2);
+  return streamdata;
 }
 
-static SEXP get_audio_info(AVFormatContext *demuxer){
+static SEXP get_audio_info(media_info *info){
+  if(!info->has_audio)
+    return R_NilValue;
   SEXP names = PROTECT(Rf_allocVector(STRSXP, 7));
   SET_STRING_ELT(names, 0, Rf_mkChar("channels"));
   SET_STRING_ELT(names, 1, Rf_mkChar("sample_rate"));
@@ -61,55 +279,125 @@ static SEXP get_audio_info(AVFormatContext *demuxer){
   SET_STRING_ELT(names, 4, Rf_mkChar("bitrate"));
   SET_STRING_ELT(names, 5, Rf_mkChar("layout"));
   SET_STRING_ELT(names, 6, Rf_mkChar("sample_fmt"));
-  for (int i = 0; i < demuxer->nb_streams; i++) {
-    AVStream *stream = demuxer->streams[i];
-    if(stream->codecpar->codec_type != AVMEDIA_TYPE_AUDIO)
-      continue;
-    const AVCodec *codec = avcodec_find_decoder(stream->codecpar->codec_id);
-    if(!codec)
-      Rf_error("Failed to find codec");
-    SEXP streamdata = PROTECT(Rf_allocVector(VECSXP, Rf_length(names)));
-#ifdef NEW_CHANNEL_API
-    SET_VECTOR_ELT(streamdata, 0, Rf_ScalarInteger(stream->codecpar->ch_layout.nb_channels));
-#else
-    SET_VECTOR_ELT(streamdata, 0, Rf_ScalarInteger(stream->codecpar->channels));
-#endif
-    SET_VECTOR_ELT(streamdata, 1, Rf_ScalarInteger(stream->codecpar->sample_rate));
-    SET_VECTOR_ELT(streamdata, 2, safe_string(codec->name));
-    SET_VECTOR_ELT(streamdata, 3, Rf_ScalarInteger(stream->nb_frames ? stream->nb_frames : NA_INTEGER));
-    SET_VECTOR_ELT(streamdata, 4, Rf_ScalarInteger(stream->codecpar->bit_rate));
-
-    char layout[1024] = "";
-#ifdef NEW_CHANNEL_API
-    av_channel_layout_describe(&stream->codecpar->ch_layout, layout, 1024);
-#else
-    av_get_channel_layout_string(layout, 1024, stream->codecpar->channels, stream->codecpar->channel_layout);
-#endif
-    SET_VECTOR_ELT(streamdata, 5, safe_string(layout));
-    SET_VECTOR_ELT(streamdata, 6, safe_string(av_get_sample_fmt_name(stream->codecpar->format)));
-    Rf_setAttrib(streamdata, R_NamesSymbol, names);
-    UNPROTECT(2);
-    return streamdata;
-  }
-  UNPROTECT(1);
-  return R_NilValue;
+  SEXP streamdata = PROTECT(Rf_allocVector(VECSXP, Rf_length(names)));
+  SET_VECTOR_ELT(streamdata, 0, Rf_ScalarInteger(info->channels));
+  SET_VECTOR_ELT(streamdata, 1, Rf_ScalarInteger(info->sample_rate));
+  SET_VECTOR_ELT(streamdata, 2, safe_string(info->audio_codec));
+  SET_VECTOR_ELT(streamdata, 3, Rf_ScalarInteger(info->audio_frames ? info->audio_frames : NA_INTEGER));
+  SET_VECTOR_ELT(streamdata, 4, Rf_ScalarInteger(info->bitrate));
+  SET_VECTOR_ELT(streamdata, 5, safe_string(info->layout));
+  SET_VECTOR_ELT(streamdata, 6, safe_string(info->sample_fmt));
+  Rf_setAttrib(streamdata, R_NamesSymbol, names);
+  UNPROTECT(2);
+  return streamdata;
 }
 
-SEXP R_video_info(SEXP file){
-  AVFormatContext *demuxer = NULL;
-  bail_if(avformat_open_input(&demuxer, CHAR(STRING_ELT(file, 0)), NULL, NULL), "avformat_open_input");
-  bail_if(avformat_find_stream_info(demuxer, NULL), "avformat_find_stream_info");
+/* The input of an av_open() handle has been probed already */
+SEXP R_video_info(SEXP file, SEXP fast){
+  media_info info = {0};
+  if(is_media_handle(file)){
+    info.file = media_handle_path(file);
+    read_media_info(&info, media_handle_input(file)->demuxer);
+  } else {
+    info.file = CHAR(STRING_ELT(file, 0));
+    info.fast = Rf_asLogical(fast) == TRUE;
+    get_media_info(&info);
+  }
+  if(info.error[0])
+    Rf_errorcall(R_NilValue, "%s", info.error);
   SEXP out = PROTECT(Rf_allocVector(VECSXP, 3));
   SEXP outnames = PROTECT(Rf_allocVector(STRSXP, 3));
   SET_STRING_ELT(outnames, 0, Rf_mkChar("duration"));
   SET_STRING_ELT(outnames, 1, Rf_mkChar("video"));
   SET_STRING_ELT(outnames, 2, Rf_mkChar("audio"));
-  SET_VECTOR_ELT(out, 0, Rf_ScalarReal(demuxer->duration / 1e6));
-  SET_VECTOR_ELT(out, 1, get_video_info(demuxer));
-  SET_VECTOR_ELT(out, 2, get_audio_info(demuxer));
+  SET_VECTOR_ELT(out, 0, Rf_ScalarReal(info.duration));
+  SET_VECTOR_ELT(out, 1, get_video_info(&info));
+  SET_VECTOR_ELT(out, 2, get_audio_info(&info));
   Rf_setAttrib(out, R_NamesSymbol, outnames);
   UNPROTECT(2);
-  avformat_close_input(&demuxer);
-  avformat_free_context(demuxer);
   return out;
 }
+
+/* Probes many files on a thread pool. Returns the columns of a data frame with a row
+ * for each file, with NA values for missing streams and for files that failed. */
+static void probe_batch_file(void *data, int i){
+  info_batch *batch = data;
+  get_media_info(&batch->items[i]);
+}
+
+static void close_info_batch(void *ptr, Rboolean jump){
+  info_batch *batch = ptr;
+  if(batch->pool)
+    pool_free(batch->pool);
+  av_free(batch->items);
+  av_free(batch);
+}
+
+static void set_column(SEXP out, SEXP names, int col, const char *name, SEXPTYPE type, int n){
+  SET_VECTOR_ELT(out, col, Rf_allocVector(type, n));
+  SET_STRING_ELT(names, col, Rf_mkChar(name));
+}
+
+static SEXP info_batch_result(void *ptr){
+  info_batch *batch = ptr;
+  int n = batch->nb_files;
+  if(n > 0){
+    batch->pool = pool_start(probe_batch_file, batch, n, batch->nb_threads);
+    while(pool_wait(batch->pool, 100) < n)
+      R_CheckUserInterrupt();
+  }
+  const int ncol = 15;
+  SEXP out = PROTECT(Rf_allocVector(VECSXP, ncol));
+  SEXP names = PROTECT(Rf_allocVector(STRSXP, ncol));
+  set_column(out, names, 0, "duration", REALSXP, n);
+  set_column(out, names, 1, "video_width", REALSXP, n);
+  set_column(out, names, 2, "video_height", REALSXP, n);
+  set_column(out, names, 3, "video_codec", STRSXP, n);
+  set_column(out, names, 4, "video_frames", REALSXP, n);
+  set_column(out, names, 5, "video_framerate", REALSXP, n);
+  set_column(out, names, 6, "video_format", STRSXP, n);
+  set_column(out, names, 7, "audio_channels", INTSXP, n);
+  set_column(out, names, 8, "audio_sample_rate", INTSXP, n);
+  set_column(out, names, 9, "audio_codec", STRSXP, n);
+  set_column(out, names, 10, "audio_frames", INTSXP, n);
+  set_column(out, names, 11, "audio_bitrate", INTSXP, n);
+  set_column(out, names, 12, "audio_layout", STRSXP, n);
+  set_column(out, names, 13, "audio_sample_fmt", STRSXP, n);
+  set_column(out, names, 14, "error", STRSXP, n);
+  for(int i = 0; i < n; i++){
+    media_info *info = &batch->items[i];
+    int failed = info->error[0] != 0;
+    int video = info->has_video && !failed;
+    int audio = info->has_audio && !failed;
+    REAL(VECTOR_ELT(out, 0))[i] = failed ? NA_REAL : info->duration;
+    REAL(VECTOR_ELT(out, 1))[i] = video ? info->width : NA_REAL;
+    REAL(VECTOR_ELT(out, 2))[i] = video ? info->height : NA_REAL;
+    SET_STRING_ELT(VECTOR_ELT(out, 3), i, video && info->video_codec ? Rf_mkChar(info->video_codec) : NA_STRING);
+    REAL(VECTOR_ELT(out, 4))[i] = video && info->video_frames ? info->video_frames : NA_REAL;
+    REAL(VECTOR_ELT(out, 5))[i] = video ? info->framerate : NA_REAL;
+    SET_STRING_ELT(VECTOR_ELT(out, 6), i, video && info->video_format ? Rf_mkChar(info->video_format) : NA_STRING);
+    INTEGER(VECTOR_ELT(out, 7))[i] = audio ? info->channels : NA_INTEGER;
+    INTEGER(VECTOR_ELT(out, 8))[i] = audio ? info->sample_rate : NA_INTEGER;
+    SET_STRING_ELT(VECTOR_ELT(out, 9), i, audio && info->audio_codec ? Rf_mkChar(info->audio_codec) : NA_STRING);
+    INTEGER(VECTOR_ELT(out, 10))[i] = audio && info->audio_frames ? info->audio_frames : NA_INTEGER;
+    INTEGER(VECTOR_ELT(out, 11))[i] = audio ? info->bitrate : NA_INTEGER;
+    SET_STRING_ELT(VECTOR_ELT(out, 12), i, audio ? Rf_mkChar(info->layout) : NA_STRING);
+    SET_STRING_ELT(VECTOR_ELT(out, 13), i, audio && info->sample_fmt ? Rf_mkChar(info->sample_fmt) : NA_STRING);
+    SET_STRING_ELT(VECTOR_ELT(out, 14), i, failed ? Rf_mkChar(info->error) : NA_STRING);
+  }
+  Rf_setAttrib(out, R_NamesSymbol, names);
+  UNPROTECT(2);
+  return out;
+}
+
+SEXP R_video_info_batch(SEXP files, SEXP fast, SEXP threads){
+  info_batch *batch = av_mallocz(sizeof(info_batch));
+  batch->nb_files = Rf_length(files);
+  batch->nb_threads = default_thread_count(Rf_asInteger(threads));
+  batch->items = av_calloc(FFMAX(1, batch->nb_files), sizeof(media_info));
+  for(int i = 0; i < batch->nb_files; i++){
+    batch->items[i].file = CHAR(STRING_ELT(files, i));
+    batch->items[i].fast = Rf_asLogical(fast) == TRUE;
+  }
+  return R_UnwindProtect(info_batch_result, batch, close_info_batch, batch, NULL);
+}
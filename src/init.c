@@ -5,10 +5,11 @@
 #include <libavcodec/avcodec.h>
 #include <libavformat/version.h>
 #include <libavfilter/avfilter.h>
+#include "threads.h"
 
-/* In theory this should be thread safe and R is not */
+/* In theory this should be thread safe and R is not, so drop messages from other threads */
 static void my_log_callback(void *ptr, int level, const char *fmt, va_list vargs){
-  if(level <= av_log_get_level())
+  if(level <= av_log_get_level() && is_main_thread())
     REvprintf(fmt, vargs);
 }
 
@@ -18,6 +19,8 @@ static SEXP R_log_level(SEXP new_level){
   return Rf_ScalarInteger(av_log_get_level());
 }
 
+void register_altrep_classes(DllInfo *dll);
+
 attribute_visible void R_init_av(DllInfo *dll) {
 #if LIBAVFORMAT_VERSION_MAJOR < 58 // FFmpeg 4.0
   av_register_all();
@@ -25,13 +28,20 @@ attribute_visible void R_init_av(DllInfo *dll) {
   avfilter_register_all();
 #endif
   avformat_network_init();
+  init_main_thread();
   av_log_set_callback(my_log_callback);
+  register_altrep_classes(dll);
 
   /* .Call calls */
-  extern SEXP R_audio_fft(SEXP, SEXP, SEXP, SEXP, SEXP, SEXP);
-  extern SEXP R_audio_bin(SEXP, SEXP, SEXP, SEXP, SEXP);
+  extern SEXP R_audio_fft(SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP);
+  extern SEXP R_audio_bin(SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP);
+  extern SEXP R_audio_bin_batch(SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP);
+  extern SEXP R_audio_fft_batch(SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP);
+  extern SEXP R_close_audio_reader(SEXP);
+  extern SEXP R_close_media(SEXP);
+  extern SEXP R_close_video_writer(SEXP, SEXP);
   extern SEXP R_convert_audio(SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP);
-  extern SEXP R_encode_video(SEXP, SEXP, SEXP, SEXP, SEXP, SEXP);
+  extern SEXP R_encode_video(SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP);
   extern SEXP R_generate_window(SEXP, SEXP);
   extern SEXP R_get_open_handles(void);
   extern SEXP R_list_codecs(void);
@@ -39,21 +49,54 @@ attribute_visible void R_init_av(DllInfo *dll) {
   extern SEXP R_list_filters(void);
   extern SEXP R_list_muxers(void);
   extern SEXP R_log_level(SEXP);
-  extern SEXP R_video_info(SEXP);
+  extern SEXP R_new_audio_reader(SEXP, SEXP, SEXP);
+  extern SEXP R_new_lazy_audio(SEXP, SEXP, SEXP);
+  extern SEXP R_new_video_writer(SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP);
+  extern SEXP R_open_media(SEXP, SEXP);
+  extern SEXP R_read_audio_block(SEXP, SEXP);
+  extern SEXP R_read_store(SEXP);
+  extern SEXP R_read_video_frames(SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP);
+  extern SEXP R_remux_video(SEXP, SEXP);
+  extern SEXP R_seek_audio_reader(SEXP, SEXP);
+  extern SEXP R_split_audio(SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP);
+  extern SEXP R_video_info(SEXP, SEXP);
+  extern SEXP R_video_info_batch(SEXP, SEXP, SEXP);
+  extern SEXP R_video_thumbnails(SEXP, SEXP, SEXP, SEXP, SEXP, SEXP);
+  extern SEXP R_write_video_audio(SEXP, SEXP);
+  extern SEXP R_write_video_frame(SEXP, SEXP);
 
   static const R_CallMethodDef CallEntries[] = {
-    {"R_audio_fft",        (DL_FUNC) &R_audio_fft,        6},
-    {"R_audio_bin",        (DL_FUNC) &R_audio_bin,        5},
-    {"R_convert_audio",    (DL_FUNC) &R_convert_audio,    8},
-    {"R_encode_video",     (DL_FUNC) &R_encode_video,     6},
-    {"R_generate_window",  (DL_FUNC) &R_generate_window,  2},
-    {"R_get_open_handles", (DL_FUNC) &R_get_open_handles, 0},
-    {"R_list_codecs",      (DL_FUNC) &R_list_codecs,      0},
-    {"R_list_demuxers",    (DL_FUNC) &R_list_demuxers,    0},
-    {"R_list_filters",     (DL_FUNC) &R_list_filters,     0},
-    {"R_list_muxers",      (DL_FUNC) &R_list_muxers,      0},
-    {"R_log_level",        (DL_FUNC) &R_log_level,        1},
-    {"R_video_info",       (DL_FUNC) &R_video_info,       1},
+    {"R_audio_fft",          (DL_FUNC) &R_audio_fft,          11},
+    {"R_audio_bin",          (DL_FUNC) &R_audio_bin,          8},
+    {"R_audio_bin_batch",    (DL_FUNC) &R_audio_bin_batch,    8},
+    {"R_audio_fft_batch",    (DL_FUNC) &R_audio_fft_batch,    9},
+    {"R_close_audio_reader", (DL_FUNC) &R_close_audio_reader, 1},
+    {"R_close_media",        (DL_FUNC) &R_close_media,        1},
+    {"R_close_video_writer", (DL_FUNC) &R_close_video_writer, 2},
+    {"R_convert_audio",      (DL_FUNC) &R_convert_audio,      8},
+    {"R_encode_video",       (DL_FUNC) &R_encode_video,       10},
+    {"R_generate_window",    (DL_FUNC) &R_generate_window,    2},
+    {"R_get_open_handles",   (DL_FUNC) &R_get_open_handles,   0},
+    {"R_list_codecs",        (DL_FUNC) &R_list_codecs,        0},
+    {"R_list_demuxers",      (DL_FUNC) &R_list_demuxers,      0},
+    {"R_list_filters",       (DL_FUNC) &R_list_filters,       0},
+    {"R_list_muxers",        (DL_FUNC) &R_list_muxers,        0},
+    {"R_log_level",          (DL_FUNC) &R_log_level,          1},
+    {"R_new_audio_reader",   (DL_FUNC) &R_new_audio_reader,   3},
+    {"R_new_lazy_audio",     (DL_FUNC) &R_new_lazy_audio,     3},
+    {"R_new_video_writer",   (DL_FUNC) &R_new_video_writer,   9},
+    {"R_open_media",         (DL_FUNC) &R_open_media,         2},
+    {"R_read_audio_block",   (DL_FUNC) &R_read_audio_block,   2},
+    {"R_read_store",         (DL_FUNC) &R_read_store,         1},
+    {"R_read_video_frames",  (DL_FUNC) &R_read_video_frames,  8},
+    {"R_remux_video",        (DL_FUNC) &R_remux_video,        2},
+    {"R_seek_audio_reader",  (DL_FUNC) &R_seek_audio_reader,  2},
+    {"R_split_audio",        (DL_FUNC) &R_split_audio,        7},
+    {"R_video_info",         (DL_FUNC) &R_video_info,         2},
+    {"R_video_info_batch",   (DL_FUNC) &R_video_info_batch,   3},
+    {"R_video_thumbnails",   (DL_FUNC) &R_video_thumbnails,   6},
+    {"R_write_video_audio",  (DL_FUNC) &R_write_video_audio,  2},
+    {"R_write_video_frame",  (DL_FUNC) &R_write_video_frame,  2},
     {NULL, NULL, 0}
   };
 
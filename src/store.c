@@ -0,0 +1,227 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+#include <libavutil/mem.h>
+#include "threads.h"
+#include "store.h"
+
+#define STORE_MAGIC "AVSTORE1"
+
+/* The header is 64 bytes, such that the data is aligned for any element type */
+typedef struct {
+  char magic[8];
+  int32_t type;
+  int32_t ndims;
+  int64_t dims[3];
+  int32_t sample_rate;
+  int32_t reserved[5];
+} store_header;
+
+struct mapped_store {
+  char *path;
+  int writable;
+  size_t size;
+  uint8_t *addr;
+#ifdef _WIN32
+  HANDLE file;
+  HANDLE mapping;
+#else
+  int fd;
+#endif
+};
+
+size_t store_elsize(enum store_type type){
+  switch(type){
+  case STORE_INT32: return sizeof(int32_t);
+  case STORE_DOUBLE: return sizeof(double);
+  case STORE_FLOAT32: return sizeof(float);
+  case STORE_INT16: return sizeof(int16_t);
+  }
+  return 0;
+}
+
+static void unmap_store(mapped_store *store){
+  if(store->addr == NULL)
+    return;
+#ifdef _WIN32
+  UnmapViewOfFile(store->addr);
+  CloseHandle(store->mapping);
+  store->mapping = NULL;
+#else
+  munmap(store->addr, store->size);
+#endif
+  store->addr = NULL;
+}
+
+/* Writable stores are shared with the file, read-only stores are mapped copy-on-write,
+ * such that R can modify the vector without changing the file. Returns 0 on success. */
+static int map_store(mapped_store *store){
+#ifdef _WIN32
+  if(store->writable){
+    LARGE_INTEGER size = {.QuadPart = store->size};
+    if(!SetFilePointerEx(store->file, size, NULL, FILE_BEGIN) || !SetEndOfFile(store->file))
+      return -1;
+  }
+  DWORD protect = store->writable ? PAGE_READWRITE : PAGE_WRITECOPY;
+  DWORD access = store->writable ? FILE_MAP_WRITE : FILE_MAP_COPY;
+  store->mapping = CreateFileMappingA(store->file, NULL, protect, 0, 0, NULL);
+  if(store->mapping == NULL)
+    return -1;
+  store->addr = MapViewOfFile(store->mapping, access, 0, 0, store->size);
+  if(store->addr == NULL){
+    CloseHandle(store->mapping);
+    store->mapping = NULL;
+    return -1;
+  }
+#else
+  if(store->writable && ftruncate(store->fd, store->size))
+    return -1;
+  int flags = store->writable ? MAP_SHARED : MAP_PRIVATE;
+  void *addr = mmap(NULL, store->size, PROT_READ | PROT_WRITE, flags, store->fd, 0);
+  if(addr == MAP_FAILED)
+    return -1;
+  store->addr = addr;
+#endif
+  return 0;
+}
+
+static const char *last_error(void){
+#ifdef _WIN32
+  return "system error";
+#else
+  return strerror(errno);
+#endif
+}
+
+static void fail_store(mapped_store *store, const char *what){
+  char message[1024];
+  snprintf(message, sizeof(message), "Failed to %s %s: %s", what, store->path, last_error());
+  store_close(store);
+  raise_error("%s", message);
+}
+
+static mapped_store *open_store(const char *path, int writable){
+  mapped_store *store = av_mallocz(sizeof(mapped_store));
+  store->path = av_strdup(path);
+  store->writable = writable;
+#ifdef _WIN32
+  store->file = INVALID_HANDLE_VALUE;
+  store->file = CreateFileA(path, writable ? GENERIC_READ | GENERIC_WRITE : GENERIC_READ, FILE_SHARE_READ,
+                            NULL, writable ? CREATE_ALWAYS : OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+  if(store->file == INVALID_HANDLE_VALUE)
+    fail_store(store, "open");
+  LARGE_INTEGER size;
+  GetFileSizeEx(store->file, &size);
+  store->size = size.QuadPart;
+#else
+  store->fd = open(path, writable ? O_RDWR | O_CREAT | O_TRUNC : O_RDONLY, 0644);
+  if(store->fd < 0)
+    fail_store(store, "open");
+  struct stat st;
+  fstat(store->fd, &st);
+  store->size = st.st_size;
+#endif
+  return store;
+}
+
+mapped_store *store_create(const char *path, enum store_type type){
+  mapped_store *store = open_store(path, 1);
+  store->size = sizeof(store_header);
+  if(map_store(store))
+    fail_store(store, "map");
+  store_header *header = (store_header *) store->addr;
+  memset(header, 0, sizeof(store_header));
+  memcpy(header->magic, STORE_MAGIC, 8);
+  header->type = type;
+  return store;
+}
+
+mapped_store *store_open(const char *path){
+  mapped_store *store = open_store(path, 0);
+  if(store->size < sizeof(store_header)){
+    store_close(store);
+    raise_error("File %s is not a valid av store", path);
+  }
+  if(map_store(store))
+    fail_store(store, "map");
+  store_header *header = (store_header *) store->addr;
+  if(memcmp(header->magic, STORE_MAGIC, 8) || store_elsize(header->type) == 0 ||
+     store->size < sizeof(store_header) + store_length(store) * store_elsize(header->type)){
+    store_close(store);
+    raise_error("File %s is not a valid av store", path);
+  }
+  return store;
+}
+
+/* Sets the size of the data, the contents up to the new size are preserved */
+void store_resize(mapped_store *store, size_t bytes){
+  unmap_store(store);
+  store->size = sizeof(store_header) + bytes;
+  if(map_store(store))
+    raise_error("Failed to resize %s: %s", store->path, last_error());
+}
+
+/* Dimensions are only written when the data is complete */
+void store_finish(mapped_store *store, int ndims, const int64_t *dims, int sample_rate){
+  store_header *header = (store_header *) store->addr;
+  header->ndims = ndims;
+  for(int i = 0; i < ndims && i < 3; i++)
+    header->dims[i] = dims[i];
+  header->sample_rate = sample_rate;
+#ifdef _WIN32
+  FlushViewOfFile(store->addr, 0);
+#else
+  msync(store->addr, store->size, MS_SYNC);
+#endif
+}
+
+void store_close(mapped_store *store){
+  if(store == NULL)
+    return;
+  unmap_store(store);
+#ifdef _WIN32
+  if(store->file != INVALID_HANDLE_VALUE)
+    CloseHandle(store->file);
+#else
+  if(store->fd >= 0)
+    close(store->fd);
+#endif
+  av_free(store->path);
+  av_free(store);
+}
+
+void *store_data(mapped_store *store){
+  return store->addr + sizeof(store_header);
+}
+
+enum store_type store_get_type(mapped_store *store){
+  return ((store_header *) store->addr)->type;
+}
+
+int64_t store_length(mapped_store *store){
+  store_header *header = (store_header *) store->addr;
+  int64_t len = header->ndims > 0;
+  for(int i = 0; i < header->ndims && i < 3; i++)
+    len *= header->dims[i];
+  return len;
+}
+
+int store_dims(mapped_store *store, int64_t *dims){
+  store_header *header = (store_header *) store->addr;
+  for(int i = 0; i < header->ndims && i < 3; i++)
+    dims[i] = header->dims[i];
+  return header->ndims;
+}
+
+int store_sample_rate(mapped_store *store){
+  return ((store_header *) store->addr)->sample_rate;
+}
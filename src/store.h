@@ -0,0 +1,20 @@
+/* File backed storage for results that do not fit in memory. The file starts with a
+ * small header that describes the data, followed by the raw (native endian) values.
+ * The store is mapped into memory for writing while decoding, and afterwards it is
+ * mapped again read-only to back an ALTREP vector that pages in data on demand. */
+
+typedef struct mapped_store mapped_store;
+
+enum store_type { STORE_INT32 = 1, STORE_DOUBLE, STORE_FLOAT32, STORE_INT16 };
+
+mapped_store *store_create(const char *path, enum store_type type);
+mapped_store *store_open(const char *path);
+void store_resize(mapped_store *store, size_t bytes);
+void store_finish(mapped_store *store, int ndims, const int64_t *dims, int sample_rate);
+void store_close(mapped_store *store);
+void *store_data(mapped_store *store);
+enum store_type store_get_type(mapped_store *store);
+int64_t store_length(mapped_store *store);
+int store_dims(mapped_store *store, int64_t *dims);
+int store_sample_rate(mapped_store *store);
+size_t store_elsize(enum store_type type);
@@ -0,0 +1,234 @@
+#include <pthread.h>
+#include <setjmp.h>
+#include <stdarg.h>
+#include <string.h>
+#include <sys/time.h>
+#include <libavutil/cpu.h>
+#include <libavutil/mem.h>
+#include <Rinternals.h>
+#include "threads.h"
+
+typedef struct {
+  jmp_buf jmpbuf;
+  thread_pool *pool;
+  char message[1024];
+} worker_context;
+
+struct thread_pool {
+  pthread_t *threads;
+  pthread_mutex_t lock;
+  pthread_cond_t done;
+  pthread_cond_t wake;
+  pool_task task;
+  pool_task cleanup;
+  void *data;
+  char **errors;
+  int n_threads;
+  int n_tasks;
+  int next;
+  int completed;
+  int first_failed;
+  int joined;
+  int persistent;
+  volatile int cancelled;
+};
+
+static pthread_t main_thread;
+static __thread worker_context *current_worker = NULL;
+
+void init_main_thread(void){
+  main_thread = pthread_self();
+}
+
+int is_main_thread(void){
+  return pthread_equal(pthread_self(), main_thread);
+}
+
+/* Zero means one thread per core */
+int default_thread_count(int threads){
+  return threads > 0 ? threads : av_cpu_count();
+}
+
+void raise_error(const char *fmt, ...){
+  char buf[1024];
+  va_list ap;
+  va_start(ap, fmt);
+  vsnprintf(buf, sizeof(buf), fmt, ap);
+  va_end(ap);
+  if(current_worker){
+    memcpy(current_worker->message, buf, sizeof(buf));
+    longjmp(current_worker->jmpbuf, 1);
+  }
+  Rf_errorcall(R_NilValue, "%s", buf);
+}
+
+/* Warnings from workers are dropped, the R API is not available there */
+void raise_warning(const char *fmt, ...){
+  char buf[1024];
+  va_list ap;
+  va_start(ap, fmt);
+  vsnprintf(buf, sizeof(buf), fmt, ap);
+  va_end(ap);
+  if(!current_worker)
+    Rf_warningcall(R_NilValue, "%s", buf);
+}
+
+/* Workers stop when the main thread cancels the pool, e.g. after CTRL+C */
+void check_interrupt(void){
+  if(current_worker == NULL){
+    R_CheckUserInterrupt();
+  } else if(current_worker->pool->cancelled){
+    raise_error("Interrupted");
+  }
+}
+
+static int next_task(thread_pool *pool){
+  pthread_mutex_lock(&pool->lock);
+  while(pool->persistent && !pool->cancelled && pool->next >= pool->n_tasks)
+    pthread_cond_wait(&pool->wake, &pool->lock);
+  int i = pool->cancelled || pool->next >= pool->n_tasks ? -1 : pool->next++;
+  pthread_mutex_unlock(&pool->lock);
+  return i;
+}
+
+static void run_task(thread_pool *pool, worker_context *ctx, int i){
+  char *error = NULL;
+  if(setjmp(ctx->jmpbuf) == 0){
+    pool->task(pool->data, i);
+  } else {
+    error = av_strdup(ctx->message);
+    if(pool->cleanup)
+      pool->cleanup(pool->data, i);
+  }
+  pthread_mutex_lock(&pool->lock);
+  pool->errors[i] = error;
+  if(error && pool->first_failed < 0)
+    pool->first_failed = i;
+  pool->completed++;
+  pthread_cond_signal(&pool->done);
+  pthread_mutex_unlock(&pool->lock);
+}
+
+static void *worker_main(void *arg){
+  worker_context ctx = {0};
+  ctx.pool = arg;
+  current_worker = &ctx;
+  int i;
+  while((i = next_task(ctx.pool)) >= 0)
+    run_task(ctx.pool, &ctx, i);
+  current_worker = NULL;
+  return NULL;
+}
+
+thread_pool *pool_start(pool_task task, void *data, int n_tasks, int n_threads){
+  return pool_start_with_cleanup(task, NULL, data, n_tasks, n_threads);
+}
+
+static thread_pool *new_pool(pool_task task, pool_task cleanup, void *data, int n_tasks, int n_threads, int persistent);
+
+/* The threads of a persistent pool stay alive after the tasks have completed, and run
+ * the same tasks again for every pool_restart(), until the pool is freed. */
+thread_pool *pool_start_persistent(pool_task task, void *data, int n_tasks, int n_threads){
+  return new_pool(task, NULL, data, n_tasks, n_threads, 1);
+}
+
+/* Starts the next round of a persistent pool. Only valid after all tasks have completed. */
+void pool_restart(thread_pool *pool){
+  pthread_mutex_lock(&pool->lock);
+  for(int i = 0; i < pool->n_tasks; i++){
+    av_free(pool->errors[i]);
+    pool->errors[i] = NULL;
+  }
+  pool->first_failed = -1;
+  pool->completed = 0;
+  pool->next = 0;
+  pthread_cond_broadcast(&pool->wake);
+  pthread_mutex_unlock(&pool->lock);
+}
+
+/* The cleanup function runs on the worker right after a task has failed, such that the
+ * resources of that task can be freed while the other tasks continue. It must not fail. */
+thread_pool *pool_start_with_cleanup(pool_task task, pool_task cleanup, void *data, int n_tasks, int n_threads){
+  return new_pool(task, cleanup, data, n_tasks, n_threads, 0);
+}
+
+static thread_pool *new_pool(pool_task task, pool_task cleanup, void *data, int n_tasks, int n_threads, int persistent){
+  thread_pool *pool = av_mallocz(sizeof(thread_pool));
+  pool->persistent = persistent;
+  pool->task = task;
+  pool->cleanup = cleanup;
+  pool->data = data;
+  pool->n_tasks = n_tasks;
+  pool->first_failed = -1;
+  pool->errors = av_calloc(n_tasks, sizeof(char*));
+  pool->threads = av_calloc(n_threads, sizeof(pthread_t));
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->done, NULL);
+  pthread_cond_init(&pool->wake, NULL);
+  for(int i = 0; i < n_threads && i < n_tasks; i++){
+    if(pthread_create(&pool->threads[i], NULL, worker_main, pool))
+      break;
+    pool->n_threads++;
+  }
+  if(pool->n_threads == 0){
+    pool_free(pool);
+    raise_error("Failed to start worker threads");
+  }
+  return pool;
+}
+
+/* Returns the number of completed tasks */
+int pool_wait(thread_pool *pool, int timeout_ms){
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  int64_t usec = now.tv_usec + (int64_t) timeout_ms * 1000;
+  struct timespec deadline = {now.tv_sec + usec / 1000000, (usec % 1000000) * 1000};
+  pthread_mutex_lock(&pool->lock);
+  if(pool->completed < pool->n_tasks)
+    pthread_cond_timedwait(&pool->done, &pool->lock, &deadline);
+  int completed = pool->completed;
+  pthread_mutex_unlock(&pool->lock);
+  return completed;
+}
+
+/* Index of the task that failed first, or -1 */
+int pool_first_failed(thread_pool *pool){
+  pthread_mutex_lock(&pool->lock);
+  int failed = pool->first_failed;
+  pthread_mutex_unlock(&pool->lock);
+  return failed;
+}
+
+/* Error message of a task, or NULL. Only valid after the task has completed */
+const char *pool_error(thread_pool *pool, int i){
+  pthread_mutex_lock(&pool->lock);
+  const char *error = pool->errors[i];
+  pthread_mutex_unlock(&pool->lock);
+  return error;
+}
+
+/* Stops running tasks at their next check_interrupt() and joins the threads */
+void pool_cancel(thread_pool *pool){
+  pthread_mutex_lock(&pool->lock);
+  pool->cancelled = 1;
+  pthread_cond_broadcast(&pool->wake);
+  pthread_mutex_unlock(&pool->lock);
+  if(pool->joined)
+    return;
+  for(int i = 0; i < pool->n_threads; i++)
+    pthread_join(pool->threads[i], NULL);
+  pool->joined = 1;
+}
+
+/* Safe to call from a cleanup handler, e.g. after CTRL+C */
+void pool_free(thread_pool *pool){
+  pool_cancel(pool);
+  for(int i = 0; i < pool->n_tasks; i++)
+    av_free(pool->errors[i]);
+  pthread_mutex_destroy(&pool->lock);
+  pthread_cond_destroy(&pool->done);
+  pthread_cond_destroy(&pool->wake);
+  av_free(pool->errors);
+  av_free(pool->threads);
+  av_free(pool);
+}
@@ -0,0 +1,23 @@
+/* Helpers for running native code on worker threads. Worker threads must never call
+ * the R API, so errors raised via raise_error() on a worker jump back into the pool
+ * and are stored as a message for the main thread to report. */
+
+typedef struct thread_pool thread_pool;
+typedef void (*pool_task)(void *data, int i);
+
+void init_main_thread(void);
+int is_main_thread(void);
+int default_thread_count(int threads);
+void raise_error(const char *fmt, ...);
+void raise_warning(const char *fmt, ...);
+void check_interrupt(void);
+
+thread_pool *pool_start(pool_task task, void *data, int n_tasks, int n_threads);
+thread_pool *pool_start_with_cleanup(pool_task task, pool_task cleanup, void *data, int n_tasks, int n_threads);
+thread_pool *pool_start_persistent(pool_task task, void *data, int n_tasks, int n_threads);
+void pool_restart(thread_pool *pool);
+int pool_wait(thread_pool *pool, int timeout_ms);
+int pool_first_failed(thread_pool *pool);
+const char *pool_error(thread_pool *pool, int i);
+void pool_cancel(thread_pool *pool);
+void pool_free(thread_pool *pool);
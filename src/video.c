@@ -4,31 +4,49 @@
 #include <libavcodec/avcodec.h>
 #include <libavutil/channel_layout.h>
 #include <libavutil/opt.h>
+#include <libavutil/audio_fifo.h>
+#include <libavutil/pixdesc.h>
 
 #define PTS_EVERYTHING 1e18
 #define VIDEO_TIME_BASE 1000
+#define AUDIO_BATCH_FRAMES 64
+#define VIDEO_BATCH_FRAMES 4
 #include <Rinternals.h>
 #include "avcompat.h"
+#include "threads.h"
+#include "handle.h"
 
 enum AVPixelFormat get_default_pix_fmt(const AVCodec *codec);
 enum AVSampleFormat get_default_sample_fmt(const AVCodec *codec);
+void set_decoder_threads(AVCodecContext *decoder, int threads);
 
 int total_open_handles = 0;
 
-typedef struct {
-  int completed;
-  AVFormatContext *demuxer;
-  AVCodecContext *decoder;
-  AVStream *stream;
-} input_container;
-
 typedef struct {
   AVFilterContext *input;
   AVFilterContext *output;
   AVFilterGraph *graph;
 } filter_container;
 
+/* Pixel buffer owned by an R object, wrapped without copying */
+typedef struct {
+  uint8_t *data;
+  int width;
+  int height;
+  int linesize;
+  enum AVPixelFormat format;
+} raster_image;
+
+/* Decoded frames that are passed between the main thread and the workers */
 typedef struct {
+  AVFrame **frames;
+  int capacity;
+  int size;
+  int eof;
+  int progress_pct;
+} frame_batch;
+
+typedef struct output_container {
   const AVCodec *codec;
   AVFormatContext *muxer;
   input_container *audio_input;
@@ -51,7 +69,38 @@ typedef struct {
   int sample_rate;
   int bit_rate;
   int early_end;
-  SEXP in_files;
+  int threads;
+  const char **in_files;
+  raster_image *in_rasters;
+  int in_count;
+  AVDictionary *codec_options;
+  struct output_container **segments;
+  int nb_segments;
+  int is_segment;
+  int copy_rasters;
+  int64_t start_time;
+  int64_t *sample_times;
+  double *keyframe_times;
+  int nb_samples;
+  int64_t first_pts;
+  thread_pool *pool;
+  AVPacket *input_pkt;
+  AVFrame *input_frame;
+  AVFrame *filter_frame;
+  AVFrame *previous_frame;
+  AVPacket *video_pkt;
+  AVPacket *audio_pkt;
+  AVFrame *audio_frame;
+  AVAudioFifo *audio_fifo;
+  int64_t audio_samples;
+  struct output_container **branches;
+  int nb_branches;
+  frame_batch *batches;
+  frame_batch *batch;
+  int nb_batches;
+  int next_file;
+  int frames_read;
+  int seeking;
 } output_container;
 
 static void warn_if(int ret, const char * what){
@@ -61,7 +110,7 @@ static void warn_if(int ret, const char * what){
 
 static void bail_if(int ret, const char * what){
   if(ret < 0)
-    Rf_errorcall(R_NilValue, "FFMPEG error in '%s': %s", what, av_err2str(ret));
+    raise_error("FFMPEG error in '%s': %s", what, av_err2str(ret));
 }
 
 static void bail_if_null(const void * ptr, const char * what){
@@ -81,11 +130,13 @@ static void close_input(input_container **x){
   input_container *input = *x;
   if(input == NULL)
     return;
+  *x = NULL;
+  if(input->shared)
+    return;
   avcodec_free_context(&(input->decoder));
   avformat_close_input(&input->demuxer);
   avformat_free_context(input->demuxer);
   av_free(input);
-  *x = NULL;
 }
 
 static filter_container * new_filter_container(AVFilterContext *input, AVFilterContext *output, AVFilterGraph *graph){
@@ -103,17 +154,60 @@ static void close_filter_container(filter_container *filter){
   av_free(filter);
 }
 
+static output_container *new_output_container(void){
+  output_container *out = av_mallocz(sizeof(output_container));
+  out->first_pts = AV_NOPTS_VALUE;
+  out->input_pkt = av_packet_alloc();
+  out->input_frame = av_frame_alloc();
+  out->filter_frame = av_frame_alloc();
+  out->previous_frame = av_frame_alloc();
+  out->video_pkt = av_packet_alloc();
+  out->audio_pkt = av_packet_alloc();
+  out->audio_frame = av_frame_alloc();
+  return out;
+}
+
 static void close_output_file(void *ptr, Rboolean jump){
   total_open_handles--;
   output_container *output = ptr;
+
+  /* Workers must be stopped before their segments can be closed */
+  if(output->pool != NULL){
+    pool_free(output->pool);
+    output->pool = NULL;
+  }
+  for(int i = 0; i < output->nb_segments; i++){
+    if(output->segments[i] != NULL)
+      close_output_file(output->segments[i], jump);
+  }
+  av_free(output->segments);
+  for(int i = 0; i < output->nb_branches; i++){
+    if(output->branches[i] != NULL){
+      /* Branches borrow the audio input of the parent */
+      output->branches[i]->audio_input = NULL;
+      close_output_file(output->branches[i], jump);
+    }
+  }
+  av_free(output->branches);
+  if(output->batches != NULL){
+    for(int i = 0; i < output->nb_batches; i++){
+      for(int j = 0; j < output->batches[i].capacity; j++)
+        av_frame_free(&output->batches[i].frames[j]);
+      av_free(output->batches[i].frames);
+    }
+    av_free(output->batches);
+  }
+  av_dict_free(&output->codec_options);
   if(output->audio_input != NULL){
     close_input(&output->audio_input);
   }
   if(output->video_input != NULL){
     close_input(&output->video_input);
   }
-  if(output->video_encoder != NULL){
+  if(output->video_filter != NULL){
     close_filter_container(output->video_filter);
+  }
+  if(output->video_encoder != NULL){
     avcodec_free_context(&(output->video_encoder));
   }
   if(output->audio_encoder != NULL){
@@ -129,6 +223,15 @@ static void close_output_file(void *ptr, Rboolean jump){
     avformat_close_input(&output->muxer);
     avformat_free_context(output->muxer);
   }
+  av_packet_free(&output->input_pkt);
+  av_frame_free(&output->input_frame);
+  av_frame_free(&output->filter_frame);
+  av_frame_free(&output->previous_frame);
+  av_packet_free(&output->video_pkt);
+  av_packet_free(&output->audio_pkt);
+  av_frame_free(&output->audio_frame);
+  if(output->audio_fifo != NULL)
+    av_audio_fifo_free(output->audio_fifo);
   av_free(output);
 }
 
@@ -146,7 +249,7 @@ static int find_stream_video(AVFormatContext *demuxer, const char *file){
   if(out < 0){
     avformat_close_input(&demuxer);
     avformat_free_context(demuxer);
-    Rf_error("Input %s does not contain suitable video stream", file);
+    raise_error("Input %s does not contain suitable video stream", file);
   }
   return out;
 }
@@ -156,12 +259,18 @@ static int find_stream_audio(AVFormatContext *demuxer, const char *file){
   if(out < 0){
     avformat_close_input(&demuxer);
     avformat_free_context(demuxer);
-    Rf_error("Input %s does not contain suitable audio stream", file);
+    raise_error("Input %s does not contain suitable audio stream", file);
   }
   return out;
 }
 
-static input_container *open_audio_input(SEXP audio){
+static input_container *open_audio_input(SEXP audio, int threads){
+  if(is_media_handle(audio)){
+    input_container *input = media_handle_input(audio);
+    open_audio_decoder(input, media_handle_path(audio), threads);
+    rewind_input(input);
+    return input;
+  }
   const char *filename = CHAR(STRING_ELT(audio, 0));
   const char *fmt = NULL;
   int channels = 0;
@@ -181,6 +290,7 @@ static input_container *open_audio_input(SEXP audio){
   bail_if_null(codec, "avcodec_find_decoder");
   AVCodecContext *decoder = avcodec_alloc_context3(codec);
   bail_if(avcodec_parameters_to_context(decoder, stream->codecpar), "avcodec_parameters_to_context");
+  set_decoder_threads(decoder, threads);
   bail_if(avcodec_open2(decoder, codec, NULL), "avcodec_open2 (audio)");
 #ifdef NEW_CHANNEL_API
   if(channels)
@@ -274,10 +384,11 @@ static filter_container *open_audio_filter(AVCodecContext *decoder, AVCodecConte
   return new_filter_container(buffersrc_ctx, buffersink_ctx, filter_graph);
 }
 
-static filter_container *open_video_filter(AVFrame * input, enum AVPixelFormat fmt, const char *filter_spec){
+static filter_container *open_video_filter(AVFrame * input, enum AVPixelFormat fmt, const char *filter_spec, int threads){
 
   /* Create a new filter graph */
   AVFilterGraph *filter_graph = avfilter_graph_alloc();
+  filter_graph->nb_threads = threads;
 
   /* Initiate source filter */
   char input_args[512];
@@ -342,12 +453,15 @@ static void add_video_output(output_container *output, int width, int height){
   if (output->muxer->oformat->flags & AVFMT_GLOBALHEADER)
     video_encoder->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
 
-  /* Open the codec, and set some x264 preferences */
-  bail_if(avcodec_open2(video_encoder, output->codec, NULL), "avcodec_open2");
-  if (output->codec->id == AV_CODEC_ID_H264){
-    bail_if(av_opt_set(video_encoder->priv_data, "preset", "slow", 0), "Set x264 preset to slow");
-    //bail_if(av_opt_set(video_encoder->priv_data, "crf", "0", 0), "Set x264 quality to lossless");
-  }
+  /* Open the codec with user options such as preset, crf, tune, g, x264-params */
+  AVDictionary *opts = NULL;
+  av_dict_copy(&opts, output->codec_options, 0);
+  int ret = avcodec_open2(video_encoder, output->codec, &opts);
+  const AVDictionaryEntry *unused = NULL;
+  while((unused = av_dict_get(opts, "", unused, AV_DICT_IGNORE_SUFFIX)))
+    raise_warning("Option '%s' not used by encoder %s", unused->key, output->codec->name);
+  av_dict_free(&opts);
+  bail_if(ret, "avcodec_open2");
 
   /* Start a video stream */
   AVStream *video_stream = avformat_new_stream(output->muxer, output->codec);
@@ -359,6 +473,20 @@ static void add_video_output(output_container *output, int width, int height){
   output->video_encoder = video_encoder;
 }
 
+static AVStream *add_stream_copy(AVFormatContext *muxer, AVStream *input_stream){
+  AVStream *stream = avformat_new_stream(muxer, NULL);
+  bail_if_null(stream, "avformat_new_stream");
+  bail_if(avcodec_parameters_copy(stream->codecpar, input_stream->codecpar), "avcodec_parameters_copy");
+  stream->codecpar->codec_tag = 0;
+  stream->time_base = input_stream->time_base;
+  return stream;
+}
+
+/* Stream copy the video from the first segment of a parallel encode */
+static void add_video_copy(output_container *output){
+  output->video_stream = add_stream_copy(output->muxer, output->video_input->stream);
+}
+
 static void add_audio_output(output_container *container){
   AVCodecContext *audio_decoder = container->audio_input->decoder;
   const AVCodec *output_codec = avcodec_find_encoder(container->muxer->oformat->audio_codec);
@@ -382,7 +510,12 @@ static void add_audio_output(output_container *container){
   audio_stream->time_base.num = 1;
   bail_if(avcodec_open2(audio_encoder, output_codec, NULL), "avcodec_open2 (audio)");
   bail_if(avcodec_parameters_from_context(audio_stream->codecpar, audio_encoder), "avcodec_parameters_from_context (audio)");
-  container->audio_filter = open_audio_filter(audio_decoder, audio_encoder, "anull");
+  /* After seeking, drop samples before the start time and shift to 0, like the video */
+  char filter_spec[128] = "anull";
+  if(container->start_time > 0)
+    snprintf(filter_spec, sizeof(filter_spec), "atrim=start=%f,asetpts=PTS-STARTPTS",
+             (double) container->start_time / AV_TIME_BASE);
+  container->audio_filter = open_audio_filter(audio_decoder, audio_encoder, filter_spec);
   container->audio_encoder = audio_encoder;
   container->audio_stream = audio_stream;
 }
@@ -395,7 +528,9 @@ static void open_output_file(int width, int height, output_container *output){
   output->muxer = muxer;
 
   /* Init video encoder */
-  if(output->in_files != NULL)
+  if(output->nb_segments > 0)
+    add_video_copy(output);
+  else if(output->codec != NULL)
     add_video_output(output, width, height);
 
   /* Add audio stream if needed */
@@ -416,14 +551,10 @@ static void sync_audio_stream(output_container * output, int64_t pts){
   int force_everything = pts == PTS_EVERYTHING;
   input_container * input = output->audio_input;
   AVStream *audio_stream = output->audio_stream;
-  if(input == NULL || input->completed)
+  if(input == NULL || input->completed || input->demuxer == NULL)
     return;
-  static AVPacket *pkt = NULL;
-  static AVFrame *frame = NULL;
-  if(pkt == NULL){
-    pkt = av_packet_alloc();
-    frame = av_frame_alloc();
-  }
+  AVPacket *pkt = output->audio_pkt;
+  AVFrame *frame = output->audio_frame;
   while(force_everything || force_flush ||
         av_compare_ts(output->end_pts, audio_stream->time_base,
                                      pts, output->video_stream->time_base) < 0) {
@@ -483,7 +614,7 @@ static void sync_audio_stream(output_container * output, int64_t pts){
       if(output->max_pts > 0 && output->max_pts < elapsed_pts){
         force_flush = 1;
       };
-      R_CheckUserInterrupt();
+      check_interrupt();
       av_packet_unref(pkt);
     }
   }
@@ -491,10 +622,66 @@ static void sync_audio_stream(output_container * output, int64_t pts){
   av_frame_unref(frame);
 }
 
+/* Samples written by the user are queued in a fifo until the muxer has been opened.
+ * Returns 1 when the encoder has been flushed. */
+static int recode_audio_packets(output_container *output){
+  AVPacket *pkt = output->audio_pkt;
+  AVFrame *frame = output->audio_frame;
+  while(1){
+    int ret = avcodec_receive_packet(output->audio_encoder, pkt);
+    if(ret == AVERROR(EAGAIN)){
+      ret = av_buffersink_get_frame(output->audio_filter->output, frame);
+      if(ret == AVERROR(EAGAIN))
+        return 0;
+      if(ret == AVERROR_EOF){
+        bail_if(avcodec_send_frame(output->audio_encoder, NULL), "avcodec_send_frame (audio flush)");
+      } else {
+        bail_if(ret, "av_buffersink_get_frame (audio)");
+        bail_if(avcodec_send_frame(output->audio_encoder, frame), "avcodec_send_frame (audio)");
+        av_frame_unref(frame);
+      }
+    } else if(ret == AVERROR_EOF){
+      return 1;
+    } else {
+      bail_if(ret, "avcodec_receive_packet (audio)");
+      pkt->stream_index = output->audio_stream->index;
+      av_packet_rescale_ts(pkt, output->audio_encoder->time_base, output->audio_stream->time_base);
+      bail_if(av_interleaved_write_frame(output->muxer, pkt), "av_interleaved_write_frame");
+      av_packet_unref(pkt);
+    }
+  }
+}
+
+static void write_audio_samples(output_container *output, int flush){
+  input_container *input = output->audio_input;
+  if(output->muxer == NULL || input->completed)
+    return;
+  AVFrame *frame = output->audio_frame;
+  while(av_audio_fifo_size(output->audio_fifo) > 0){
+    frame->nb_samples = FFMIN(av_audio_fifo_size(output->audio_fifo), 4096);
+    frame->format = input->decoder->sample_fmt;
+    frame->sample_rate = input->decoder->sample_rate;
+#ifdef NEW_CHANNEL_API
+    bail_if(av_channel_layout_copy(&frame->ch_layout, &input->decoder->ch_layout), "av_channel_layout_copy");
+#else
+    frame->channels = input->decoder->channels;
+    frame->channel_layout = input->decoder->channel_layout;
+#endif
+    bail_if(av_frame_get_buffer(frame, 0), "av_frame_get_buffer (audio)");
+    bail_if(av_audio_fifo_read(output->audio_fifo, (void**) frame->data, frame->nb_samples), "av_audio_fifo_read");
+    frame->pts = output->audio_samples;
+    output->audio_samples += frame->nb_samples;
+    bail_if(av_buffersrc_add_frame(output->audio_filter->input, frame), "av_buffersrc_add_frame (audio)");
+    recode_audio_packets(output);
+  }
+  if(flush){
+    bail_if(av_buffersrc_add_frame(output->audio_filter->input, NULL), "flushing filter");
+    input->completed = recode_audio_packets(output);
+  }
+}
+
 static int recode_output_packet(output_container *output){
-  static AVPacket *pkt = NULL;
-  if(pkt == NULL)
-    pkt = av_packet_alloc();
+  AVPacket *pkt = output->video_pkt;
   while(1){
     int ret = avcodec_receive_packet(output->video_encoder, pkt);
     if (ret == AVERROR(EAGAIN))
@@ -504,6 +691,8 @@ static int recode_output_packet(output_container *output){
       return 1;
     }
     bail_if(ret, "avcodec_receive_packet");
+    if(output->first_pts == AV_NOPTS_VALUE)
+      output->first_pts = pkt->pts;
     pkt->stream_index = output->video_stream->index;
     av_log(NULL, AV_LOG_INFO, "\rAdding frame %d at timestamp %.2fsec (%d%%)",
            (int) output->video_stream->nb_frames + 1, (double) pkt->pts / VIDEO_TIME_BASE, output->progress_pct);
@@ -511,21 +700,22 @@ static int recode_output_packet(output_container *output){
     sync_audio_stream(output, pkt->pts);
     bail_if(av_interleaved_write_frame(output->muxer, pkt), "av_interleaved_write_frame");
     av_packet_unref(pkt);
-    R_CheckUserInterrupt();
+    check_interrupt();
   }
 }
 
 /* Loop over frames returned by filter */
 static int encode_output_frames(output_container *output){
-  static AVFrame * frame = NULL;
-  if(frame == NULL)
-    frame = av_frame_alloc();
+  AVFrame *frame = output->filter_frame;
   while(1){
     int ret = av_buffersink_get_frame(output->video_filter->output, frame);
     if(ret == AVERROR(EAGAIN))
       return 0;
     if(ret == AVERROR_EOF){
-      bail_if_null(output, "filter did not return any frames");
+      /* A segment can be empty if the filter drops all of its frames, e.g. trim */
+      if(output->video_encoder == NULL && output->is_segment)
+        return 1;
+      bail_if_null(output->video_encoder, "filter did not return any frames");
       bail_if(avcodec_send_frame(output->video_encoder, NULL), "avcodec_send_frame (flush video)");
       output->early_end = 1; //trim filter can EOF before input is fully drained
     } else {
@@ -550,31 +740,59 @@ static int feed_to_filter(AVFrame * image, output_container *output){
   if(output->early_end)
     return 1;
   enum AVPixelFormat pix_fmt = get_default_pix_fmt(output->codec);
-  static AVFrame *previous = NULL;
-  if(previous == NULL)
-    previous = av_frame_alloc();
+  AVFrame *previous = output->previous_frame;
   if(output->video_filter == NULL){
     if(image == NULL){
-      Rf_error("Failed to read any input images");
+      raise_error("Failed to read any input images");
     } else {
-      output->video_filter = open_video_filter(image, pix_fmt, output->filter_string);
+      output->video_filter = open_video_filter(image, pix_fmt, output->filter_string, output->threads);
     }
   }
   if(image != NULL){
     /* Release the previous image and update with current one. This should be cheap. */
     av_frame_unref(previous);
     av_frame_ref(previous, image);
-  } else {
-    /* Add a copy of the final frame before closing the filter */
+  } else if(output->sample_times == NULL) {
+    /* Add a copy of the final frame before closing the filter (not for thumbnails) */
     previous->pts = (output->count++) * output->duration;
     bail_if(av_buffersrc_add_frame(output->video_filter->input, previous), "av_buffersrc_add_frame");
-    av_frame_free(&previous);
   }
   bail_if(av_buffersrc_add_frame(output->video_filter->input, image), "av_buffersrc_add_frame");
   return encode_output_frames(output);
 }
 
-static void read_from_input(const char *filename, output_container *output){
+/* Seek to the keyframe before 'start' (in AV_TIME_BASE units), from where we decode and drop frames */
+static void seek_to_start(AVFormatContext *demuxer, AVStream *stream, int64_t start){
+  int64_t ts = av_rescale_q(start, AV_TIME_BASE_Q, stream->time_base);
+  if(stream->start_time != AV_NOPTS_VALUE)
+    ts += stream->start_time;
+  if(av_seek_frame(demuxer, stream->index, ts, AVSEEK_FLAG_BACKWARD) < 0)
+    av_log(NULL, AV_LOG_WARNING, "Failed to seek in input, decoding from the start instead\n");
+}
+
+/* Time of a decoded frame in AV_TIME_BASE units, relative to the start of the stream */
+static int64_t get_frame_time(AVFrame *frame, AVStream *stream){
+  int64_t ts = frame->best_effort_timestamp;
+  if(ts == AV_NOPTS_VALUE)
+    return AV_NOPTS_VALUE;
+  if(stream->start_time != AV_NOPTS_VALUE)
+    ts -= stream->start_time;
+  return av_rescale_q(ts, stream->time_base, AV_TIME_BASE_Q);
+}
+
+/* Single images, as opposed to actual video: inputs of the image demuxers (image2 and the
+ * *_pipe formats), formats without timestamps, or a stream with a single frame */
+static int is_still_image(input_container *input){
+  const AVInputFormat *format = input->demuxer->iformat;
+  size_t len = strlen(format->name);
+  if(!strcmp(format->name, "image2") || !strcmp(format->name, "image2pipe"))
+    return 1;
+  if(len > 5 && !strcmp(format->name + len - 5, "_pipe"))
+    return 1;
+  return (format->flags & AVFMT_NOTIMESTAMPS) || input->stream->nb_frames == 1;
+}
+
+static input_container *open_video_input(const char *filename, output_container *output){
   AVFormatContext *demuxer = NULL;
   bail_if(avformat_open_input(&demuxer, filename, NULL, NULL), "avformat_open_input");
   bail_if(avformat_find_stream_info(demuxer, NULL), "avformat_find_stream_info");
@@ -588,87 +806,507 @@ static void read_from_input(const char *filename, output_container *output){
   output->video_input = new_input_container(demuxer, decoder, stream);
   bail_if(avcodec_parameters_to_context(decoder, stream->codecpar), "avcodec_parameters_to_context");
   decoder->framerate = av_guess_frame_rate(demuxer, stream, NULL);
+
+  /* Spawning decoder threads only pays off for actual video, not single images */
+  if(!is_still_image(output->video_input))
+    set_decoder_threads(decoder, output->threads);
   bail_if(avcodec_open2(decoder, codec, NULL), "avcodec_open2");
+  return output->video_input;
+}
 
-  /* Allocate data storage */
-  static AVPacket *pkt = NULL;
-  static AVFrame *picture = NULL;
-  if(pkt == NULL){
-    pkt = av_packet_alloc();
-    picture = av_frame_alloc();
-  }
-  int ret;
-  do {
-    ret = av_read_frame(demuxer, pkt);
-    if(ret == AVERROR_EOF){
-      bail_if(avcodec_send_packet(decoder, NULL), "flushing avcodec_send_packet");
-    } else {
-      bail_if(ret, "av_read_frame");
-      if(pkt->stream_index != si){
+static void start_video_input(const char *filename, output_container *output){
+  input_container *input = open_video_input(filename, output);
+  output->frames_read = 0;
+
+  /* An image has a single frame at time 0, so the start time only applies to video */
+  output->seeking = output->start_time > 0 && !is_still_image(input);
+  if(output->seeking)
+    seek_to_start(input->demuxer, input->stream, output->start_time);
+}
+
+/* Decode the next frame of the current input, returns 0 at the end of the input */
+static int decode_video_frame(const char *filename, output_container *output, AVFrame *picture){
+  input_container *input = output->video_input;
+  AVCodecContext *decoder = input->decoder;
+  AVStream *stream = input->stream;
+  AVPacket *pkt = output->input_pkt;
+  while(1){
+    int ret = avcodec_receive_frame(decoder, picture);
+    if(ret == AVERROR(EAGAIN)){
+      ret = av_read_frame(input->demuxer, pkt);
+      if(ret == AVERROR_EOF){
+        bail_if(avcodec_send_packet(decoder, NULL), "flushing avcodec_send_packet");
+      } else {
+        bail_if(ret, "av_read_frame");
+        if(pkt->stream_index == stream->index)
+          bail_if(avcodec_send_packet(decoder, pkt), "avcodec_send_packet");
         av_packet_unref(pkt);
-        continue; //wrong stream
       }
-      bail_if(avcodec_send_packet(decoder, pkt), "avcodec_send_packet");
+      continue;
     }
+    if(ret == AVERROR_EOF)
+      return 0;
+    bail_if(ret, "avcodec_receive_frame");
+
+    /* Drop frames between the keyframe and the requested start, the output starts at 0 */
+    if(output->seeking){
+      int64_t time = get_frame_time(picture, stream);
+      if(time != AV_NOPTS_VALUE && time < output->start_time){
+        av_frame_unref(picture);
+        continue;
+      }
+      output->seeking = 0;
+    }
+
+    /* Segment timestamps are derived from the file index */
+    if(output->is_segment && output->frames_read++ > 0)
+      raise_error("Parallel segments require single image input files but %s is a video", filename);
+    picture->pts = (output->count++) * output->duration;
+    //prevent keyframe at each image
+    //todo: find a way to do this for all length 1 input formats
+    if(is_still_image(input))
+      picture->pict_type = AV_PICTURE_TYPE_NONE;
+    return 1;
+  }
+}
+
+static void read_from_input(const char *filename, output_container *output){
+  start_video_input(filename, output);
+  AVFrame *picture = output->input_frame;
+  while(!output->early_end && decode_video_frame(filename, output, picture))
+    feed_to_filter(picture, output);
+  close_input(&output->video_input);
+}
+
+/* Runs on a worker thread, must not touch the R API. Continues decoding the input
+ * files where the previous batch stopped, and opens the next file when needed. */
+static void decode_video_batch(void *data, int i){
+  output_container *output = data;
+  frame_batch *batch = output->batch;
+  for(int j = 0; j < batch->size; j++)
+    av_frame_unref(batch->frames[j]);
+  batch->size = 0;
+  while(batch->size < batch->capacity){
+    if(output->video_input == NULL){
+      if(output->next_file == output->in_count){
+        batch->eof = 1;
+        return;
+      }
+      start_video_input(output->in_files[output->next_file++], output);
+    }
+    batch->progress_pct = (output->next_file - 1) * 100 / output->in_count;
+    if(decode_video_frame(output->in_files[output->next_file - 1], output, batch->frames[batch->size])){
+      batch->size++;
+    } else {
+      close_input(&output->video_input);
+    }
+  }
+}
+
+/* Decode a single keyframe at each of the sample times. For each sample we seek back to the
+ * nearest keyframe, send only that packet and drain the decoder. Hence the cost depends on
+ * the number of samples rather than the length of the video. */
+static void read_keyframes(const char *filename, output_container *output){
+  input_container *input = open_video_input(filename, output);
+  AVCodecContext *decoder = input->decoder;
+  AVStream *stream = input->stream;
+  AVPacket *pkt = output->input_pkt;
+  AVFrame *picture = output->input_frame;
+  int64_t previous = AV_NOPTS_VALUE;
+  decoder->skip_frame = AVDISCARD_NONKEY;
+  for(int i = 0; i < output->nb_samples && !output->early_end; i++){
+    output->progress_pct = i * 100 / output->nb_samples;
+    seek_to_start(input->demuxer, stream, output->sample_times[i]);
+    avcodec_flush_buffers(decoder);
+    int ret;
+    while((ret = av_read_frame(input->demuxer, pkt)) == 0){
+      if(pkt->stream_index == stream->index && (pkt->flags & AV_PKT_FLAG_KEY))
+        break;
+      av_packet_unref(pkt);
+    }
+    if(ret == AVERROR_EOF)
+      break;
+    bail_if(ret, "av_read_frame");
+    bail_if(avcodec_send_packet(decoder, pkt), "avcodec_send_packet");
     av_packet_unref(pkt);
+    bail_if(avcodec_send_packet(decoder, NULL), "flushing avcodec_send_packet");
     int ret2 = avcodec_receive_frame(decoder, picture);
-    if(ret2 == AVERROR(EAGAIN))
-      continue;
     if(ret2 == AVERROR_EOF)
-      break;
+      continue;
     bail_if(ret2, "avcodec_receive_frame");
+
+    /* Sample points within the same GOP give the same keyframe */
+    int64_t time = get_frame_time(picture, stream);
+    if(time != AV_NOPTS_VALUE && time == previous){
+      av_frame_unref(picture);
+      continue;
+    }
+    previous = time;
+    output->keyframe_times[output->count] = time == AV_NOPTS_VALUE ? NA_REAL : (double) time / AV_TIME_BASE;
     picture->pts = (output->count++) * output->duration;
-    //prevent keyframe at each image
-    //todo: find a way to do this for all length 1 input formats
-    if(decoder->codec->id == AV_CODEC_ID_PNG || decoder->codec->id == AV_CODEC_ID_MJPEG)
-      picture->pict_type = AV_PICTURE_TYPE_NONE;
     feed_to_filter(picture, output);
-  } while(ret != AVERROR_EOF && !output->early_end);
+    av_frame_unref(picture);
+  }
   close_input(&output->video_input);
 }
 
+/* The R object stays protected for the duration of the encoding so there is nothing to free */
+static void release_raster(void *opaque, uint8_t *data){}
+
+static void read_from_raster(raster_image *raster, output_container *output){
+  AVFrame *picture = output->input_frame;
+  picture->buf[0] = av_buffer_create(raster->data, raster->linesize * raster->height,
+                                     release_raster, NULL, AV_BUFFER_FLAG_READONLY);
+  bail_if_null(picture->buf[0], "av_buffer_create");
+  picture->data[0] = raster->data;
+  picture->linesize[0] = raster->linesize;
+  picture->width = raster->width;
+  picture->height = raster->height;
+  picture->format = raster->format;
+  if(output->copy_rasters)
+    bail_if(av_frame_make_writable(picture), "av_frame_make_writable");
+  picture->pts = (output->count++) * output->duration;
+  feed_to_filter(picture, output);
+  av_frame_unref(picture);
+}
+
+static void create_frame_batches(output_container *output, int n, int capacity){
+  output->batches = av_calloc(n, sizeof(frame_batch));
+  output->nb_batches = n;
+  for(int i = 0; i < n; i++){
+    output->batches[i].frames = av_calloc(capacity, sizeof(AVFrame*));
+    output->batches[i].capacity = capacity;
+    for(int j = 0; j < capacity; j++)
+      output->batches[i].frames[j] = av_frame_alloc();
+  }
+}
+
+static frame_batch *other_batch(output_container *output, frame_batch *batch){
+  return batch == &output->batches[0] ? &output->batches[1] : &output->batches[0];
+}
+
+/* Waits for the current round of a persistent pool, the workers stay alive */
+static void wait_for_round(output_container *output, int n){
+  while(pool_wait(output->pool, 100) < n && pool_first_failed(output->pool) < 0)
+    R_CheckUserInterrupt();
+  int failed = pool_first_failed(output->pool);
+  if(failed >= 0){
+    pool_cancel(output->pool);
+    raise_error("%s", pool_error(output->pool, failed));
+  }
+}
+
+/* Starts the workers for the first batch, and hands over every next batch to the same threads */
+static void start_round(output_container *output, pool_task task, int n, int threads){
+  if(output->pool == NULL){
+    output->pool = pool_start_persistent(task, output, n, threads);
+  } else {
+    pool_restart(output->pool);
+  }
+}
+
+static void stop_pool(output_container *output){
+  pool_free(output->pool);
+  output->pool = NULL;
+}
+
+/* The input files are decoded on a worker thread, one batch ahead of the main thread
+ * which runs the filter graph, the encoders and the muxer. Hence decoding overlaps with
+ * encoding, rather than adding up. */
+static void encode_files_pipelined(output_container *output){
+  create_frame_batches(output, 2, VIDEO_BATCH_FRAMES);
+  output->batch = &output->batches[0];
+  start_round(output, decode_video_batch, 1, 1);
+  wait_for_round(output, 1);
+  while(1){
+    frame_batch *ready = output->batch;
+    if(!ready->eof){
+      output->batch = other_batch(output, ready);
+      start_round(output, decode_video_batch, 1, 1);
+    }
+    output->progress_pct = ready->progress_pct;
+    for(int i = 0; i < ready->size && !output->early_end; i++)
+      feed_to_filter(ready->frames[i], output);
+    if(!ready->eof)
+      wait_for_round(output, 1);
+    if(ready->eof || output->early_end)
+      break;
+  }
+  stop_pool(output);
+  close_input(&output->video_input);
+  if(!feed_to_filter(NULL, output))
+    raise_warning("Did not reach EOF, video may be incomplete");
+}
+
+static void encode_files(output_container *output){
+  /* Segments already run on worker threads */
+  if(output->in_files != NULL && is_main_thread()){
+    encode_files_pipelined(output);
+    return;
+  }
+  for(int fi = 0; fi < output->in_count; fi++){
+    output->progress_pct = fi * 100 / output->in_count;
+    if(output->in_rasters != NULL){
+      read_from_raster(&output->in_rasters[fi], output);
+    } else {
+      read_from_input(output->in_files[fi], output);
+    }
+  }
+  if(!feed_to_filter(NULL, output))
+    raise_warning("Did not reach EOF, video may be incomplete");
+}
+
 /* Loop over input image files files */
 static SEXP encode_input_files(void *ptr){
   total_open_handles++;
   output_container *output = ptr;
-  int len = Rf_length(output->in_files);
-  for(int fi = 0; fi < len; fi++){
-    output->progress_pct = fi * 100 / len;
-    read_from_input(CHAR(STRING_ELT(output->in_files, fi)), output);
+  encode_files(output);
+
+  /* Flush audio stream */
+  sync_audio_stream(output, -1);
+  return R_NilValue;
+}
+
+/* Runs on a worker thread, must not touch the R API */
+static void encode_segment(void *data, int i){
+  output_container *output = data;
+  encode_files(output->segments[i]);
+}
+
+static void open_segment_input(output_container *output, const char *filename){
+  AVFormatContext *demuxer = NULL;
+  bail_if(avformat_open_input(&demuxer, filename, NULL, NULL), "avformat_open_input");
+  bail_if(avformat_find_stream_info(demuxer, NULL), "avformat_find_stream_info");
+  int si = find_stream_video(demuxer, filename);
+  output->video_input = new_input_container(demuxer, NULL, demuxer->streams[si]);
+}
+
+/* Each segment ends with a copy of its final frame, such that the filter knows the correct
+ * end time. This copy has the same pts as the start of the next segment so we drop it. */
+static void join_segments(output_container *output, const char **files, int64_t *start_pts){
+  AVPacket *pkt = output->video_pkt;
+  AVRational video_time_base = {1, VIDEO_TIME_BASE};
+  for(int i = 0; i < output->nb_segments; i++){
+    if(start_pts[i] == AV_NOPTS_VALUE)
+      continue;
+    int64_t end_pts = INT64_MAX;
+    for(int j = i + 1; j < output->nb_segments && end_pts == INT64_MAX; j++){
+      if(start_pts[j] != AV_NOPTS_VALUE)
+        end_pts = start_pts[j];
+    }
+    close_input(&output->video_input);
+    open_segment_input(output, files[i]);
+    if(output->muxer == NULL)
+      open_output_file(0, 0, output);
+    AVStream *stream = output->video_input->stream;
+    while(1){
+      int ret = av_read_frame(output->video_input->demuxer, pkt);
+      if(ret == AVERROR_EOF)
+        break;
+      bail_if(ret, "av_read_frame");
+      if(pkt->stream_index != stream->index || av_rescale_q(pkt->pts, stream->time_base, video_time_base) >= end_pts){
+        av_packet_unref(pkt);
+        continue;
+      }
+      pkt->stream_index = output->video_stream->index;
+      pkt->pos = -1;
+      av_packet_rescale_ts(pkt, stream->time_base, output->video_stream->time_base);
+      av_log(NULL, AV_LOG_INFO, "\rAdding frame %d at timestamp %.2fsec (segment %d/%d)",
+             (int) output->video_stream->nb_frames + 1, pkt->pts * av_q2d(output->video_stream->time_base),
+             i + 1, output->nb_segments);
+      sync_audio_stream(output, pkt->pts);
+      bail_if(av_interleaved_write_frame(output->muxer, pkt), "av_interleaved_write_frame");
+      av_packet_unref(pkt);
+      check_interrupt();
+    }
+  }
+  if(output->muxer == NULL)
+    raise_error("Filter did not return any frames");
+  av_log(NULL, AV_LOG_INFO, " - video stream completed!\n");
+  close_input(&output->video_input);
+}
+
+/* Encode contiguous chunks of the input in parallel, and then join them by stream copy */
+static SEXP encode_input_segments(void *ptr){
+  output_container *output = ptr;
+  int n = output->nb_segments;
+  total_open_handles += n + 1;
+  output->pool = pool_start(encode_segment, output, n, n);
+  int done = 0;
+  while((done = pool_wait(output->pool, 100)) < n && pool_first_failed(output->pool) < 0){
+    av_log(NULL, AV_LOG_INFO, "\rEncoding %d segments in parallel (%d done)", n, done);
+    R_CheckUserInterrupt();
   }
-  if(!feed_to_filter(NULL, output))
-    Rf_warning("Did not reach EOF, video may be incomplete");
+  int failed = pool_first_failed(output->pool);
+  if(failed >= 0){
+    pool_cancel(output->pool);
+    raise_error("%s", pool_error(output->pool, failed));
+  }
+  pool_free(output->pool);
+  output->pool = NULL;
+  av_log(NULL, AV_LOG_INFO, "\rEncoding %d segments in parallel (%d done)\n", n, n);
+
+  /* Finalize the segment files before reading them back */
+  const char **files = (const char **) R_alloc(n, sizeof(char*));
+  int64_t *start_pts = (int64_t *) R_alloc(n, sizeof(int64_t));
+  for(int i = 0; i < n; i++){
+    output_container *segment = output->segments[i];
+    files[i] = segment->output_file;
+    start_pts[i] = segment->muxer ? segment->first_pts : AV_NOPTS_VALUE;
+    output->segments[i] = NULL;
+    close_output_file(segment, FALSE);
+  }
+  join_segments(output, files, start_pts);
 
   /* Flush audio stream */
   sync_audio_stream(output, -1);
   return R_NilValue;
 }
 
+static void create_segments(output_container *output, SEXP segment_files){
+  int n = Rf_length(segment_files);
+  output->nb_segments = n;
+  output->segments = av_calloc(n, sizeof(output_container*));
+  for(int i = 0; i < n; i++){
+    int first = (int64_t) output->in_count * i / n;
+    int last = (int64_t) output->in_count * (i + 1) / n;
+    output_container *segment = new_output_container();
+    segment->is_segment = 1;
+    segment->codec = output->codec;
+    segment->duration = output->duration;
+    segment->filter_string = output->filter_string;
+    segment->threads = output->threads;
+    segment->in_files = output->in_files ? output->in_files + first : NULL;
+    segment->in_rasters = output->in_rasters ? output->in_rasters + first : NULL;
+    segment->in_count = last - first;
+    segment->count = first;
+    segment->format_name = "nut";
+    segment->output_file = CHAR(STRING_ELT(segment_files, i));
+
+    /* Joining by pts requires dts == pts so we disable B-frames. Also divide the cores. */
+    av_dict_copy(&segment->codec_options, output->codec_options, 0);
+    av_dict_set(&segment->codec_options, "bf", "0", 0);
+    av_dict_set_int(&segment->codec_options, "threads", FFMAX(1, default_thread_count(0) / n), AV_DICT_DONT_OVERWRITE);
+    output->segments[i] = segment;
+  }
+}
+
+/* Supports nativeRaster (packed RGBA integers) or raw arrays of dim (channels, width, height) */
+static void get_raster_image(SEXP x, raster_image *out){
+  SEXP dim = Rf_getAttrib(x, R_DimSymbol);
+  if(TYPEOF(x) == INTSXP && Rf_length(dim) == 2){
+    out->data = (uint8_t*) INTEGER(x);
+    out->height = INTEGER(dim)[0];
+    out->width = INTEGER(dim)[1];
+    out->linesize = out->width * sizeof(int);
+    out->format = AV_PIX_FMT_BGR32; // native endian 0xAABBGGRR
+  } else if(TYPEOF(x) == RAWSXP && Rf_length(dim) == 3){
+    int channels = INTEGER(dim)[0];
+    out->data = RAW(x);
+    out->width = INTEGER(dim)[1];
+    out->height = INTEGER(dim)[2];
+    out->linesize = out->width * channels;
+    switch(channels){
+    case 1: out->format = AV_PIX_FMT_GRAY8; break;
+    case 2: out->format = AV_PIX_FMT_YA8; break;
+    case 3: out->format = AV_PIX_FMT_RGB24; break;
+    case 4: out->format = AV_PIX_FMT_RGBA; break;
+    default: raise_error("Unsupported number of channels in raw array: %d", channels);
+    }
+  } else {
+    raise_error("Unsupported frame: must be a nativeRaster or raw array");
+  }
+}
+
 static const AVCodec *get_default_codec(const char *filename){
   const AVOutputFormat *frmt = av_guess_format(NULL, filename, NULL);
   bail_if_null(frmt, "av_guess_format");
   return avcodec_find_encoder(frmt->video_codec);
 }
 
-SEXP R_encode_video(SEXP in_files, SEXP out_file, SEXP framerate, SEXP vfilter,
-                    SEXP enc, SEXP audio){
+static output_container *new_video_output(SEXP out_file, SEXP framerate, SEXP vfilter,
+                                          SEXP enc, SEXP audio, SEXP threads, SEXP options){
   const AVCodec *codec = Rf_length(enc) ?
     avcodec_find_encoder_by_name(CHAR(STRING_ELT(enc, 0))) :
     get_default_codec(CHAR(STRING_ELT(out_file, 0)));
   bail_if_null(codec, "avcodec_find_encoder_by_name");
-
-  /* Start the output video */
-  output_container *output = av_mallocz(sizeof(output_container));
-  output->audio_input = Rf_length(audio) ? open_audio_input(audio) : NULL;
+  input_container *audio_input = Rf_length(audio) ? open_audio_input(audio, Rf_asInteger(threads)) : NULL;
+  output_container *output = new_output_container();
+  output->threads = Rf_asInteger(threads);
+  output->audio_input = audio_input;
   output->output_file = CHAR(STRING_ELT(out_file, 0));
   output->duration = VIDEO_TIME_BASE / Rf_asReal(framerate);
   output->filter_string = CHAR(STRING_ELT(vfilter, 0));
   output->codec = codec;
-  output->in_files = in_files;
-  R_UnwindProtect(encode_input_files, output, close_output_file, output, NULL);
+  SEXP optnames = Rf_getAttrib(options, R_NamesSymbol);
+  for(int i = 0; i < Rf_length(options); i++)
+    av_dict_set(&output->codec_options, CHAR(STRING_ELT(optnames, i)), CHAR(STRING_ELT(options, i)), 0);
+  return output;
+}
+
+SEXP R_encode_video(SEXP in_files, SEXP out_file, SEXP framerate, SEXP vfilter, SEXP enc,
+                    SEXP audio, SEXP threads, SEXP options, SEXP segment_files, SEXP start_time){
+  /* In-memory frames are wrapped directly in AVFrames */
+  raster_image *rasters = NULL;
+  if(!Rf_isString(in_files)){
+    rasters = (raster_image *) R_alloc(Rf_length(in_files), sizeof(raster_image));
+    for(int i = 0; i < Rf_length(in_files); i++)
+      get_raster_image(VECTOR_ELT(in_files, i), &rasters[i]);
+  }
+
+  /* Start the output video */
+  output_container *output = new_video_output(out_file, framerate, vfilter, enc, audio, threads, options);
+  output->in_count = Rf_length(in_files);
+  output->in_rasters = rasters;
+  output->start_time = Rf_length(start_time) ? Rf_asReal(start_time) * AV_TIME_BASE : 0;
+  if(output->start_time > 0 && output->audio_input != NULL)
+    seek_to_start(output->audio_input->demuxer, output->audio_input->stream, output->start_time);
+  if(rasters == NULL){
+    output->in_files = (const char **) R_alloc(output->in_count, sizeof(char*));
+    for(int i = 0; i < output->in_count; i++)
+      output->in_files[i] = CHAR(STRING_ELT(in_files, i));
+  }
+  if(Rf_length(segment_files) > 1){
+    create_segments(output, segment_files);
+    R_UnwindProtect(encode_input_segments, output, close_output_file, output, NULL);
+  } else {
+    R_UnwindProtect(encode_input_files, output, close_output_file, output, NULL);
+  }
   return out_file;
 }
 
+static SEXP encode_keyframes(void *ptr){
+  total_open_handles++;
+  output_container *output = ptr;
+  read_keyframes(output->in_files[0], output);
+  if(!feed_to_filter(NULL, output))
+    raise_warning("Did not reach EOF, thumbnails may be incomplete");
+  SEXP times = PROTECT(Rf_allocVector(REALSXP, output->count));
+  memcpy(REAL(times), output->keyframe_times, output->count * sizeof(double));
+  UNPROTECT(1);
+  return times;
+}
+
+/* Returns the times of the keyframes that were written */
+SEXP R_video_thumbnails(SEXP video, SEXP out_file, SEXP times, SEXP vfilter, SEXP enc, SEXP threads){
+  int nb_samples = Rf_length(times);
+  const char **in_files = (const char **) R_alloc(1, sizeof(char*));
+  int64_t *sample_times = (int64_t *) R_alloc(nb_samples, sizeof(int64_t));
+  double *keyframe_times = (double *) R_alloc(nb_samples, sizeof(double));
+  in_files[0] = CHAR(STRING_ELT(video, 0));
+  for(int i = 0; i < nb_samples; i++)
+    sample_times[i] = REAL(times)[i] * AV_TIME_BASE;
+  SEXP framerate = PROTECT(Rf_ScalarReal(1));
+  output_container *output = new_video_output(out_file, framerate, vfilter, enc, R_NilValue, threads, R_NilValue);
+  UNPROTECT(1);
+  output->in_count = 1;
+  output->in_files = in_files;
+  output->nb_samples = nb_samples;
+  output->sample_times = sample_times;
+  output->keyframe_times = keyframe_times;
+  return R_UnwindProtect(encode_keyframes, output, close_output_file, output, NULL);
+}
+
 /* Loop over input image files files */
 static SEXP encode_audio_input(void *ptr){
   total_open_handles++;
@@ -678,28 +1316,650 @@ static SEXP encode_audio_input(void *ptr){
   return R_NilValue;
 }
 
+/* Decode the next batch of frames for the branches. After 'max_pts' we flush the decoder. */
+static void decode_audio_batch(output_container *output, frame_batch *batch){
+  input_container *input = output->audio_input;
+  AVPacket *pkt = output->input_pkt;
+  for(int i = 0; i < batch->size; i++)
+    av_frame_unref(batch->frames[i]);
+  batch->size = 0;
+  while(batch->size < batch->capacity){
+    AVFrame *frame = batch->frames[batch->size];
+    int ret = avcodec_receive_frame(input->decoder, frame);
+    if(ret == AVERROR(EAGAIN)){
+      ret = output->early_end ? AVERROR_EOF : av_read_frame(input->demuxer, pkt);
+      if(ret == AVERROR_EOF){
+        bail_if(avcodec_send_packet(input->decoder, NULL), "avcodec_send_packet (flush)");
+      } else {
+        bail_if(ret, "av_read_frame");
+        if(pkt->stream_index == input->stream->index){
+          av_packet_rescale_ts(pkt, input->stream->time_base, input->decoder->time_base);
+          bail_if(avcodec_send_packet(input->decoder, pkt), "avcodec_send_packet (audio)");
+        }
+        av_packet_unref(pkt);
+      }
+    } else if(ret == AVERROR_EOF){
+      batch->eof = 1;
+      return;
+    } else {
+      bail_if(ret, "avcodec_receive_frame");
+      if(output->max_pts > 0 && frame->pts != AV_NOPTS_VALUE &&
+         av_rescale_q(frame->pts, input->decoder->time_base, AV_TIME_BASE_Q) > output->max_pts){
+        av_frame_unref(frame);
+        output->early_end = 1;
+      } else {
+        batch->size++;
+      }
+    }
+  }
+}
+
+/* Runs on a worker thread, must not touch the R API. Each branch keeps its own
+ * reference to the shared frames, the decoded samples are never copied. */
+static void encode_audio_branch(void *data, int i){
+  output_container *output = data;
+  output_container *branch = output->branches[i];
+  frame_batch *batch = output->batch;
+  for(int j = 0; j < batch->size; j++){
+    bail_if(av_buffersrc_add_frame_flags(branch->audio_filter->input, batch->frames[j],
+                                         AV_BUFFERSRC_FLAG_KEEP_REF), "av_buffersrc_add_frame_flags");
+    recode_audio_packets(branch);
+  }
+  if(batch->eof){
+    bail_if(av_buffersrc_add_frame(branch->audio_filter->input, NULL), "flushing filter");
+    recode_audio_packets(branch);
+  }
+}
+
+/* Decode the input once, and encode each batch of frames into all outputs in parallel.
+ * The next batch is decoded on the main thread while the workers encode the current one.
+ * The same worker threads are used for all batches. */
+static SEXP encode_audio_branches(void *ptr){
+  output_container *output = ptr;
+  int n = output->nb_branches;
+  total_open_handles += n + 1;
+  for(int i = 0; i < n; i++)
+    open_output_file(0, 0, output->branches[i]);
+  int threads = FFMIN(n, default_thread_count(0));
+  frame_batch *next = &output->batches[0];
+  decode_audio_batch(output, next);
+  while(1){
+    output->batch = next;
+    next = other_batch(output, next);
+    start_round(output, encode_audio_branch, n, threads);
+    if(!output->batch->eof)
+      decode_audio_batch(output, next);
+    wait_for_round(output, n);
+    if(output->batch->eof)
+      break;
+    AVFrame *last = output->batch->frames[output->batch->capacity - 1];
+    if(last->pts != AV_NOPTS_VALUE)
+      av_log(NULL, AV_LOG_INFO, "\rEncoding %d outputs at timestamp %.2fsec", n,
+             last->pts * av_q2d(output->audio_input->decoder->time_base));
+  }
+  stop_pool(output);
+  av_log(NULL, AV_LOG_INFO, " - audio stream completed!\n");
+  return R_NilValue;
+}
+
+static int get_int_option(SEXP x, int i){
+  if(i >= Rf_length(x) || INTEGER(x)[i] == NA_INTEGER)
+    return 0;
+  return INTEGER(x)[i];
+}
+
+static void set_audio_options(output_container *output, int i, SEXP out_file, SEXP out_format,
+                              SEXP out_channels, SEXP sample_rate, SEXP bit_rate){
+  output->output_file = CHAR(STRING_ELT(out_file, i));
+  if(i < Rf_length(out_format) && STRING_ELT(out_format, i) != NA_STRING)
+    output->format_name = CHAR(STRING_ELT(out_format, i));
+  output->channels = get_int_option(out_channels, i);
+  output->sample_rate = get_int_option(sample_rate, i);
+  output->bit_rate = get_int_option(bit_rate, i);
+}
+
+/* Each output is a branch with its own filter, encoder and muxer, fed from the parent input */
+static void create_audio_branches(output_container *output, SEXP out_file, SEXP out_format,
+                                  SEXP out_channels, SEXP sample_rate, SEXP bit_rate){
+  int n = Rf_length(out_file);
+  output->nb_branches = n;
+  output->branches = av_calloc(n, sizeof(output_container*));
+  for(int i = 0; i < n; i++){
+    output_container *branch = new_output_container();
+    set_audio_options(branch, i, out_file, out_format, out_channels, sample_rate, bit_rate);
+    branch->audio_input = output->audio_input;
+    output->branches[i] = branch;
+  }
+}
+
 SEXP R_convert_audio(SEXP audio, SEXP out_file, SEXP out_format, SEXP out_channels,
                      SEXP sample_rate, SEXP bit_rate, SEXP start_pos, SEXP max_len){
-  output_container *output = av_mallocz(sizeof(output_container));
-  if(Rf_length(out_channels))
-    output->channels = Rf_asInteger(out_channels);
-  if(Rf_length(sample_rate))
-    output->sample_rate = Rf_asInteger(sample_rate);
-  if(Rf_length(bit_rate))
-    output->bit_rate = Rf_asInteger(bit_rate);
-  if(Rf_length(out_format))
-    output->format_name = CHAR(STRING_ELT(out_format, 0));
-  output->audio_input = open_audio_input(audio);
+  output_container *output = new_output_container();
+  output->audio_input = open_audio_input(audio, 0);
   double start_pts = Rf_length(start_pos) ? Rf_asReal(start_pos) : 0;
   if(start_pts > 0)
     av_seek_frame(output->audio_input->demuxer, -1, start_pts * AV_TIME_BASE, AVSEEK_FLAG_ANY);
   if(Rf_length(max_len))
     output->max_pts = (Rf_asReal(max_len) + start_pts) * AV_TIME_BASE;
-  output->output_file = CHAR(STRING_ELT(out_file, 0));
-  R_UnwindProtect(encode_audio_input, output, close_output_file, output, NULL);
+  if(Rf_length(out_file) > 1){
+    create_audio_branches(output, out_file, out_format, out_channels, sample_rate, bit_rate);
+    create_frame_batches(output, 2, AUDIO_BATCH_FRAMES);
+    R_UnwindProtect(encode_audio_branches, output, close_output_file, output, NULL);
+  } else {
+    set_audio_options(output, 0, out_file, out_format, out_channels, sample_rate, bit_rate);
+    R_UnwindProtect(encode_audio_input, output, close_output_file, output, NULL);
+  }
   return out_file;
 }
 
+/* Send part of a decoded frame to a segment, with timestamps relative to the segment start */
+static void send_audio_samples(output_container *segment, AVFrame *frame, int offset, int nb_samples, int64_t pos){
+  AVCodecContext *decoder = segment->audio_input->decoder;
+  AVFrame *piece = segment->input_frame;
+  if(offset == 0 && nb_samples == frame->nb_samples){
+    bail_if(av_frame_ref(piece, frame), "av_frame_ref");
+  } else {
+    piece->nb_samples = nb_samples;
+    piece->format = frame->format;
+    piece->sample_rate = frame->sample_rate;
+#ifdef NEW_CHANNEL_API
+    bail_if(av_channel_layout_copy(&piece->ch_layout, &frame->ch_layout), "av_channel_layout_copy");
+    int channels = frame->ch_layout.nb_channels;
+#else
+    piece->channels = frame->channels;
+    piece->channel_layout = frame->channel_layout;
+    int channels = frame->channels;
+#endif
+    bail_if(av_frame_get_buffer(piece, 0), "av_frame_get_buffer (audio)");
+    bail_if(av_samples_copy(piece->extended_data, frame->extended_data, 0, offset, nb_samples,
+                            channels, frame->format), "av_samples_copy");
+  }
+  piece->pts = av_rescale_q(pos, (AVRational){1, frame->sample_rate}, decoder->time_base);
+  bail_if(av_buffersrc_add_frame(segment->audio_filter->input, piece), "av_buffersrc_add_frame (audio)");
+  recode_audio_packets(segment);
+}
+
+/* Flush and close the current segment, such that only one output file is open at a time */
+static int finish_audio_segment(output_container *output){
+  output_container *segment = output->branches[output->count];
+  int written = segment->muxer != NULL;
+  if(written){
+    bail_if(av_buffersrc_add_frame(segment->audio_filter->input, NULL), "flushing filter");
+    recode_audio_packets(segment);
+    av_log(NULL, AV_LOG_INFO, "\rWriting segment %d/%d", output->count + 1, output->nb_branches);
+  }
+  output->branches[output->count++] = NULL;
+  segment->audio_input = NULL;
+  close_output_file(segment, FALSE);
+  return written;
+}
+
+/* Split a frame at the cut points. The position is counted in decoded samples, so the
+ * segments are sample accurate and contiguous. Returns the number of finished segments. */
+static int split_audio_frame(output_container *output, AVFrame *frame){
+  int finished = 0;
+  int offset = 0;
+  while(offset < frame->nb_samples && output->count < output->nb_branches){
+    int i = output->count;
+    int64_t start = i > 0 ? output->sample_times[i - 1] : 0;
+    int64_t end = i < output->nb_samples ? output->sample_times[i] : INT64_MAX;
+    int nb_samples = (int) FFMIN(frame->nb_samples - offset, end - output->audio_samples);
+    output_container *segment = output->branches[i];
+    if(segment->muxer == NULL)
+      open_output_file(0, 0, segment);
+    send_audio_samples(segment, frame, offset, nb_samples, output->audio_samples - start);
+    output->audio_samples += nb_samples;
+    offset += nb_samples;
+    if(output->audio_samples == end)
+      finished += finish_audio_segment(output);
+  }
+  return finished;
+}
+
+/* Read the input once from start to end, and rotate the output file at each cut point */
+static SEXP split_audio_input(void *ptr){
+  output_container *output = ptr;
+  total_open_handles += output->nb_branches + 1;
+  for(int i = 0; i < output->nb_samples; i++){
+    if(output->sample_times[i] <= (i > 0 ? output->sample_times[i - 1] : 0))
+      raise_error("Cut points must be increasing and at least one sample apart");
+  }
+  frame_batch *batch = &output->batches[0];
+  int written = 0;
+  while(!batch->eof && output->count < output->nb_branches){
+    decode_audio_batch(output, batch);
+    for(int i = 0; i < batch->size; i++)
+      written += split_audio_frame(output, batch->frames[i]);
+    check_interrupt();
+  }
+  if(output->count < output->nb_branches)
+    written += finish_audio_segment(output);
+  av_log(NULL, AV_LOG_INFO, " - audio stream completed!\n");
+  return Rf_ScalarInteger(written);
+}
+
+SEXP R_split_audio(SEXP audio, SEXP out_file, SEXP cut_points, SEXP out_format, SEXP out_channels,
+                   SEXP sample_rate, SEXP bit_rate){
+  int nb_cuts = Rf_length(cut_points);
+  int64_t *sample_times = (int64_t *) R_alloc(nb_cuts, sizeof(int64_t));
+  output_container *output = new_output_container();
+  output->audio_input = open_audio_input(audio, 0);
+  for(int i = 0; i < nb_cuts; i++)
+    sample_times[i] = llround(REAL(cut_points)[i] * output->audio_input->decoder->sample_rate);
+  output->nb_samples = nb_cuts;
+  output->sample_times = sample_times;
+  create_audio_branches(output, out_file, out_format, out_channels, sample_rate, bit_rate);
+  create_frame_batches(output, 1, AUDIO_BATCH_FRAMES);
+  return R_UnwindProtect(split_audio_input, output, close_output_file, output, NULL);
+}
+
+/* Stream copy the first video and audio stream from demuxer to muxer without decoding */
+static SEXP remux_input_file(void *ptr){
+  total_open_handles++;
+  output_container *output = ptr;
+  AVFormatContext *demuxer = output->video_input->demuxer;
+  AVStream *video_input = output->video_input->stream;
+  int asi = find_stream_type(demuxer, AVMEDIA_TYPE_AUDIO);
+  AVStream *audio_input = asi < 0 ? NULL : demuxer->streams[asi];
+
+  AVFormatContext *muxer = NULL;
+  avformat_alloc_output_context2(&muxer, NULL, NULL, output->output_file);
+  bail_if_null(muxer, "avformat_alloc_output_context2");
+  output->muxer = muxer;
+  output->video_stream = add_stream_copy(muxer, video_input);
+  output->video_stream->avg_frame_rate = video_input->avg_frame_rate;
+  if(audio_input != NULL)
+    output->audio_stream = add_stream_copy(muxer, audio_input);
+  if (!(muxer->oformat->flags & AVFMT_NOFILE))
+    bail_if(avio_open(&muxer->pb, output->output_file, AVIO_FLAG_WRITE), "avio_open");
+  bail_if(avformat_write_header(muxer, NULL), "avformat_write_header");
+  av_dump_format(muxer, 0, output->output_file, 1);
+
+  AVPacket *pkt = output->video_pkt;
+  while(1){
+    int ret = av_read_frame(demuxer, pkt);
+    if(ret == AVERROR_EOF)
+      break;
+    bail_if(ret, "av_read_frame");
+    AVStream *in_stream = NULL;
+    AVStream *out_stream = NULL;
+    if(pkt->stream_index == video_input->index){
+      in_stream = video_input;
+      out_stream = output->video_stream;
+    } else if(audio_input != NULL && pkt->stream_index == audio_input->index){
+      in_stream = audio_input;
+      out_stream = output->audio_stream;
+    } else {
+      av_packet_unref(pkt);
+      continue;
+    }
+    pkt->stream_index = out_stream->index;
+    pkt->pos = -1;
+    av_packet_rescale_ts(pkt, in_stream->time_base, out_stream->time_base);
+    if(in_stream == video_input){
+      av_log(NULL, AV_LOG_INFO, "\rCopying frame %d at timestamp %.2fsec",
+             (int) out_stream->nb_frames + 1, pkt->pts * av_q2d(out_stream->time_base));
+    }
+    bail_if(av_interleaved_write_frame(muxer, pkt), "av_interleaved_write_frame");
+    av_packet_unref(pkt);
+    check_interrupt();
+  }
+  av_log(NULL, AV_LOG_INFO, " - video stream completed!\n");
+  return R_NilValue;
+}
+
+static int can_copy_stream(AVStream *stream, const AVOutputFormat *format){
+  if(stream->disposition & AV_DISPOSITION_ATTACHED_PIC)
+    return 0;
+  return avformat_query_codec(format, stream->codecpar->codec_id, FF_COMPLIANCE_NORMAL) == 1;
+}
+
+/* Returns FALSE without writing anything if the codecs are not supported by the output container */
+SEXP R_remux_video(SEXP in_file, SEXP out_file){
+  const char *filename = CHAR(STRING_ELT(in_file, 0));
+  const AVOutputFormat *format = av_guess_format(NULL, CHAR(STRING_ELT(out_file, 0)), NULL);
+  bail_if_null(format, "av_guess_format");
+  AVFormatContext *demuxer = NULL;
+  bail_if(avformat_open_input(&demuxer, filename, NULL, NULL), "avformat_open_input");
+  bail_if(avformat_find_stream_info(demuxer, NULL), "avformat_find_stream_info");
+  int si = find_stream_video(demuxer, filename);
+  int asi = find_stream_type(demuxer, AVMEDIA_TYPE_AUDIO);
+  if(!can_copy_stream(demuxer->streams[si], format) || (asi >= 0 && !can_copy_stream(demuxer->streams[asi], format))){
+    avformat_close_input(&demuxer);
+    return Rf_ScalarLogical(FALSE);
+  }
+  output_container *output = new_output_container();
+  output->video_input = new_input_container(demuxer, NULL, demuxer->streams[si]);
+  output->output_file = CHAR(STRING_ELT(out_file, 0));
+  R_UnwindProtect(remux_input_file, output, close_output_file, output, NULL);
+  return Rf_ScalarLogical(TRUE);
+}
+
+/* Decoding frames into R objects, without an encoder */
+typedef struct {
+  input_container *input;
+  filter_container *filter;
+  AVPacket *pkt;
+  AVFrame *picture;
+  AVFrame *frame;
+  enum AVPixelFormat format;
+  const char *filter_string;
+  int threads;
+  int native;
+  int64_t count;
+  int64_t start_time;
+  double duration;
+  double fps;
+  int width;
+  int height;
+  int channels;
+  R_xlen_t frame_size;
+} frame_reader;
+
+static void close_frame_reader(void *ptr, Rboolean jump){
+  total_open_handles--;
+  frame_reader *reader = ptr;
+  close_input(&reader->input);
+  if(reader->filter != NULL)
+    close_filter_container(reader->filter);
+  av_packet_free(&reader->pkt);
+  av_frame_free(&reader->picture);
+  av_frame_free(&reader->frame);
+  av_free(reader);
+}
+
+/* Arrays are stored with planar channels, and the filter has transposed the image
+ * such that the rows of the frame are the columns of the R matrix. */
+static void copy_frame_pixels(AVFrame *frame, uint8_t *dst, int native){
+  if(native){
+    for(int y = 0; y < frame->height; y++)
+      memcpy(dst + y * frame->width * 4, frame->data[0] + y * frame->linesize[0], frame->width * 4);
+    return;
+  }
+  const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(frame->format);
+  for(int c = 0; c < desc->nb_components; c++){
+    int plane = desc->comp[c].plane;
+    for(int y = 0; y < frame->height; y++){
+      memcpy(dst, frame->data[plane] + y * frame->linesize[plane], frame->width);
+      dst += frame->width;
+    }
+  }
+}
+
+/* The result holds the pixel data (a raw vector or a list of nativeRaster) and the timestamps */
+static void store_frame(frame_reader *reader, AVFrame *frame, SEXP result){
+  R_xlen_t n = reader->count;
+  if(Rf_xlength(VECTOR_ELT(result, 1)) <= n){
+    R_xlen_t len = n + n / 2 + 1;
+    SET_VECTOR_ELT(result, 0, Rf_xlengthgets(VECTOR_ELT(result, 0), reader->native ? len : len * reader->frame_size));
+    SET_VECTOR_ELT(result, 1, Rf_xlengthgets(VECTOR_ELT(result, 1), len));
+  }
+  SEXP data = VECTOR_ELT(result, 0);
+  REAL(VECTOR_ELT(result, 1))[n] = (double) frame->pts / VIDEO_TIME_BASE;
+  if(reader->native){
+    SEXP image = Rf_allocMatrix(INTSXP, frame->height, frame->width);
+    SET_VECTOR_ELT(data, n, image);
+    copy_frame_pixels(frame, (uint8_t*) INTEGER(image), 1);
+  } else {
+    copy_frame_pixels(frame, RAW(data) + n * reader->frame_size, 0);
+  }
+  reader->count++;
+}
+
+/* Returns 1 when the filter has reached EOF, e.g. due to trim */
+static int drain_reader_filter(frame_reader *reader, SEXP result){
+  AVFrame *frame = reader->frame;
+  while(1){
+    int ret = av_buffersink_get_frame(reader->filter->output, frame);
+    if(ret == AVERROR(EAGAIN))
+      return 0;
+    if(ret == AVERROR_EOF)
+      return 1;
+    bail_if(ret, "av_buffersink_get_frame");
+    if(reader->frame_size == 0){
+      reader->width = frame->width;
+      reader->height = frame->height;
+      reader->channels = reader->native ? 1 : av_pix_fmt_desc_get(frame->format)->nb_components;
+      reader->frame_size = (R_xlen_t) frame->width * frame->height * reader->channels;
+      if(!reader->native)
+        SET_VECTOR_ELT(result, 0, Rf_allocVector(RAWSXP, Rf_xlength(VECTOR_ELT(result, 1)) * reader->frame_size));
+    }
+    store_frame(reader, frame, result);
+    av_frame_unref(frame);
+    check_interrupt();
+  }
+}
+
+/* Number of frames that come out of the filter: the trimmed (or remaining) duration of the
+ * input at the output frame rate. The result is allocated once at this size, and only grows
+ * or shrinks at the end when the estimate was off. */
+static R_xlen_t estimate_frame_count(frame_reader *reader){
+  AVFormatContext *demuxer = reader->input->demuxer;
+  AVStream *stream = reader->input->stream;
+  double duration = demuxer->duration > 0 ? (double) (demuxer->duration - reader->start_time) / AV_TIME_BASE : 0;
+  if(reader->duration > 0 && (duration <= 0 || reader->duration < duration))
+    duration = reader->duration;
+  double fps = reader->fps > 0 ? reader->fps : stream->avg_frame_rate.den > 0 ? av_q2d(stream->avg_frame_rate) : 0;
+  if(duration > 0 && fps > 0)
+    return FFMAX(1, (R_xlen_t) ceil(duration * fps - 1e-6));
+  return stream->nb_frames > 0 ? stream->nb_frames : 100;
+}
+
+static SEXP read_video_frames(void *ptr){
+  total_open_handles++;
+  frame_reader *reader = ptr;
+  AVFormatContext *demuxer = reader->input->demuxer;
+  AVCodecContext *decoder = reader->input->decoder;
+  AVStream *stream = reader->input->stream;
+  AVPacket *pkt = reader->pkt;
+  AVFrame *picture = reader->picture;
+  int64_t last_pts = -1;
+  if(reader->start_time > 0)
+    seek_to_start(demuxer, stream, reader->start_time);
+
+  R_xlen_t estimate = estimate_frame_count(reader);
+  SEXP result = PROTECT(Rf_allocVector(VECSXP, 2));
+  SET_VECTOR_ELT(result, 0, Rf_allocVector(reader->native ? VECSXP : RAWSXP, reader->native ? estimate : 0));
+  SET_VECTOR_ELT(result, 1, Rf_allocVector(REALSXP, estimate));
+  int done = 0;
+  while(!done){
+    int ret = av_read_frame(demuxer, pkt);
+    if(ret == AVERROR_EOF){
+      bail_if(avcodec_send_packet(decoder, NULL), "flushing avcodec_send_packet");
+    } else {
+      bail_if(ret, "av_read_frame");
+      if(pkt->stream_index != stream->index){
+        av_packet_unref(pkt);
+        continue;
+      }
+      bail_if(avcodec_send_packet(decoder, pkt), "avcodec_send_packet");
+      av_packet_unref(pkt);
+    }
+    while(!done){
+      int ret2 = avcodec_receive_frame(decoder, picture);
+      if(ret2 == AVERROR(EAGAIN))
+        break;
+      if(ret2 == AVERROR_EOF){
+        if(reader->filter == NULL)
+          raise_error("Failed to read any input frames");
+        bail_if(av_buffersrc_add_frame(reader->filter->input, NULL), "av_buffersrc_add_frame");
+        drain_reader_filter(reader, result);
+        done = 1;
+        break;
+      }
+      bail_if(ret2, "avcodec_receive_frame");
+      int64_t time = get_frame_time(picture, stream);
+      if(reader->start_time > 0 && time != AV_NOPTS_VALUE && time < reader->start_time){
+        av_frame_unref(picture);
+        continue;
+      }
+      picture->pts = time == AV_NOPTS_VALUE ? last_pts + 1 : av_rescale(time, VIDEO_TIME_BASE, AV_TIME_BASE);
+      last_pts = picture->pts;
+      if(reader->filter == NULL)
+        reader->filter = open_video_filter(picture, reader->format, reader->filter_string, reader->threads);
+      bail_if(av_buffersrc_add_frame(reader->filter->input, picture), "av_buffersrc_add_frame");
+      done = drain_reader_filter(reader, result);
+    }
+  }
+
+  /* Shrink to the actual number of frames, which only copies when the estimate was too high */
+  R_xlen_t n = reader->count;
+  if(Rf_xlength(VECTOR_ELT(result, 1)) != n){
+    SET_VECTOR_ELT(result, 0, Rf_xlengthgets(VECTOR_ELT(result, 0), reader->native ? n : n * reader->frame_size));
+    SET_VECTOR_ELT(result, 1, Rf_xlengthgets(VECTOR_ELT(result, 1), n));
+  }
+  if(!reader->native && n > 0){
+    SEXP dim = PROTECT(Rf_allocVector(INTSXP, 4));
+    INTEGER(dim)[0] = reader->width;
+    INTEGER(dim)[1] = reader->height;
+    INTEGER(dim)[2] = reader->channels;
+    INTEGER(dim)[3] = n;
+    Rf_setAttrib(VECTOR_ELT(result, 0), R_DimSymbol, dim);
+    UNPROTECT(1);
+  }
+  UNPROTECT(1);
+  return result;
+}
+
+SEXP R_read_video_frames(SEXP video, SEXP vfilter, SEXP format, SEXP native, SEXP threads, SEXP start_time,
+                         SEXP duration, SEXP fps){
+  const char *filename = CHAR(STRING_ELT(video, 0));
+  enum AVPixelFormat pix_fmt = av_get_pix_fmt(CHAR(STRING_ELT(format, 0)));
+  if(pix_fmt == AV_PIX_FMT_NONE)
+    Rf_error("Unsupported pixel format: %s", CHAR(STRING_ELT(format, 0)));
+  AVFormatContext *demuxer = NULL;
+  bail_if(avformat_open_input(&demuxer, filename, NULL, NULL), "avformat_open_input");
+  bail_if(avformat_find_stream_info(demuxer, NULL), "avformat_find_stream_info");
+  int si = find_stream_video(demuxer, filename);
+  AVStream *stream = demuxer->streams[si];
+  const AVCodec *codec = avcodec_find_decoder(stream->codecpar->codec_id);
+  bail_if_null(codec, "avcodec_find_decoder");
+  AVCodecContext *decoder = avcodec_alloc_context3(codec);
+  frame_reader *reader = av_mallocz(sizeof(frame_reader));
+  reader->input = new_input_container(demuxer, decoder, stream);
+  reader->pkt = av_packet_alloc();
+  reader->picture = av_frame_alloc();
+  reader->frame = av_frame_alloc();
+  reader->format = pix_fmt;
+  reader->filter_string = CHAR(STRING_ELT(vfilter, 0));
+  reader->threads = Rf_asInteger(threads);
+  reader->native = Rf_asLogical(native);
+  reader->start_time = Rf_length(start_time) ? Rf_asReal(start_time) * AV_TIME_BASE : 0;
+  reader->duration = Rf_length(duration) ? Rf_asReal(duration) : 0;
+  reader->fps = Rf_length(fps) ? Rf_asReal(fps) : 0;
+  bail_if(avcodec_parameters_to_context(decoder, stream->codecpar), "avcodec_parameters_to_context");
+  set_decoder_threads(decoder, reader->threads);
+  bail_if(avcodec_open2(decoder, codec, NULL), "avcodec_open2");
+  return R_UnwindProtect(read_video_frames, reader, close_frame_reader, reader, NULL);
+}
+
+/* Incremental encoding: the output_container lives in an external pointer between calls */
+static void finalize_video_writer(SEXP ptr){
+  output_container *output = R_ExternalPtrAddr(ptr);
+  if(output != NULL){
+    R_ClearExternalPtr(ptr);
+    close_output_file(output, FALSE);
+  }
+}
+
+static output_container *get_video_writer(SEXP ptr){
+  if(TYPEOF(ptr) != EXTPTRSXP || R_ExternalPtrAddr(ptr) == NULL)
+    Rf_error("Video writer has been closed");
+  return R_ExternalPtrAddr(ptr);
+}
+
+/* Audio samples from R are interleaved doubles, so the 'decoder' only describes the format */
+static input_container *new_pcm_input(int sample_rate, int channels){
+  AVCodecContext *decoder = avcodec_alloc_context3(NULL);
+  bail_if_null(decoder, "avcodec_alloc_context3");
+  decoder->sample_fmt = AV_SAMPLE_FMT_DBL;
+  decoder->sample_rate = sample_rate;
+  decoder->time_base = (AVRational){1, sample_rate};
+#ifdef NEW_CHANNEL_API
+  av_channel_layout_default(&decoder->ch_layout, channels);
+#else
+  decoder->channels = channels;
+  decoder->channel_layout = av_get_default_channel_layout(channels);
+#endif
+  return new_input_container(NULL, decoder, NULL);
+}
+
+SEXP R_new_video_writer(SEXP out_file, SEXP framerate, SEXP vfilter, SEXP enc, SEXP audio,
+                        SEXP threads, SEXP options, SEXP sample_rate, SEXP channels){
+  output_container *output = new_video_output(out_file, framerate, vfilter, enc, audio, threads, options);
+  /* The writer copies the pixels because the R object may be gone before the frame
+   * leaves the filter graph and encoder. */
+  output->copy_rasters = 1;
+  if(Rf_length(sample_rate)){
+    output->audio_input = new_pcm_input(Rf_asInteger(sample_rate), Rf_asInteger(channels));
+    output->audio_fifo = av_audio_fifo_alloc(AV_SAMPLE_FMT_DBL, Rf_asInteger(channels), 1);
+  }
+  total_open_handles++;
+  SEXP strings = PROTECT(Rf_list2(out_file, vfilter));
+  SEXP ptr = PROTECT(R_MakeExternalPtr(output, R_NilValue, strings));
+  R_RegisterCFinalizerEx(ptr, finalize_video_writer, TRUE);
+  Rf_setAttrib(ptr, R_ClassSymbol, Rf_mkString("av_video_writer"));
+  UNPROTECT(2);
+  return ptr;
+}
+
+/* Frame is either a path to an image file or a list with a raster */
+SEXP R_write_video_frame(SEXP ptr, SEXP frame){
+  output_container *output = get_video_writer(ptr);
+  close_input(&output->video_input); //in case a previous call failed
+  if(Rf_isString(frame)){
+    read_from_input(CHAR(STRING_ELT(frame, 0)), output);
+  } else {
+    raster_image raster;
+    get_raster_image(VECTOR_ELT(frame, 0), &raster);
+    read_from_raster(&raster, output);
+  }
+  if(output->audio_fifo != NULL)
+    write_audio_samples(output, 0);
+  return ptr;
+}
+
+/* Samples are queued until the first video frame has opened the output file */
+SEXP R_write_video_audio(SEXP ptr, SEXP samples){
+  output_container *output = get_video_writer(ptr);
+  if(output->audio_fifo == NULL)
+    Rf_error("Video writer was not opened with an audio sample_rate");
+#ifdef NEW_CHANNEL_API
+  int channels = output->audio_input->decoder->ch_layout.nb_channels;
+#else
+  int channels = output->audio_input->decoder->channels;
+#endif
+  void *data = REAL(samples);
+  bail_if(av_audio_fifo_write(output->audio_fifo, &data, Rf_length(samples) / channels), "av_audio_fifo_write");
+  write_audio_samples(output, 0);
+  return ptr;
+}
+
+static SEXP finish_video_writer(void *ptr){
+  output_container *output = ptr;
+  if(!feed_to_filter(NULL, output))
+    raise_warning("Did not reach EOF, video may be incomplete");
+  if(output->audio_fifo != NULL){
+    write_audio_samples(output, 1);
+  } else {
+    sync_audio_stream(output, -1);
+  }
+  return R_NilValue;
+}
+
+SEXP R_close_video_writer(SEXP ptr, SEXP finish){
+  output_container *output = R_ExternalPtrAddr(ptr);
+  if(output == NULL)
+    return R_NilValue;
+  R_ClearExternalPtr(ptr);
+  if(Rf_asLogical(finish)){
+    R_UnwindProtect(finish_video_writer, output, close_output_file, output, NULL);
+  } else {
+    close_output_file(output, FALSE);
+  }
+  return CAR(R_ExternalPtrProtected(ptr));
+}
+
 SEXP R_get_open_handles(void){
   return Rf_ScalarInteger(total_open_handles);
 }